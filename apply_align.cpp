@@ -0,0 +1,65 @@
+#include "FnuAlignMap.h"
+
+#include <TFile.h>
+#include <TTree.h>
+#include <TClonesArray.h>
+
+int main(int argc, char *argv[])
+{
+	if (argc < 4)
+	{
+		printf("Usage: ./apply_align linked_tracks.root alignMap.root output.root [interp]\n");
+		printf("  Apply an alignment map written by divide_align to the segments of linked_tracks.root.\n");
+		printf("  Tracks are read and written one entry at a time, so memory does not grow with the number of tracks.\n");
+		return 1;
+	}
+	TString filename_linked_tracks = argv[1];
+	TString filename_map = argv[2];
+	TString filename_out = argv[3];
+	bool interpolate = argc > 4 && TString(argv[4]) == "interp";
+
+	FnuAlignMap map;
+	if (map.Read(filename_map) != 0)
+		return 1;
+
+	TFile fin(filename_linked_tracks);
+	if (fin.IsZombie())
+	{
+		printf("Cannot open %s\n", filename_linked_tracks.Data());
+		return 1;
+	}
+	TTree *tracks = (TTree *)fin.Get("tracks");
+	if (tracks == 0)
+	{
+		printf("No tracks tree in %s\n", filename_linked_tracks.Data());
+		return 1;
+	}
+
+	// Segments of a track are in the branch "s", the other branches are copied as they are
+	TClonesArray *segs = new TClonesArray("EdbSegP");
+	tracks->SetBranchAddress("s", &segs);
+
+	TFile fout(filename_out, "recreate");
+	TTree *out = tracks->CloneTree(0);
+	Long64_t ntrk = tracks->GetEntries();
+	for (Long64_t itrk = 0; itrk < ntrk; itrk++)
+	{
+		tracks->GetEntry(itrk);
+		for (int iseg = 0; iseg < segs->GetEntriesFast(); iseg++)
+		{
+			map.ApplySegment((EdbSegP *)segs->At(iseg), interpolate);
+		}
+		out->Fill();
+		if (0 == itrk % 10000)
+		{
+			printf("%3lld%%\r", itrk * 100 / ntrk);
+			fflush(stdout);
+		}
+	}
+	printf("100%% done, %lld tracks\n", ntrk);
+	fout.cd();
+	out->Write();
+	fout.Close();
+	fin.Close();
+	return 0;
+}
@@ -1,51 +1,300 @@
 #include "FnuDivideAlign.h"
 #include <EdbDataSet.h>
-int main(int argc, char *argv[])
+#include <TROOT.h>
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <stdlib.h>
+
+void ParseList(const char *arg, std::vector<double> &values)
 {
-	if (argc < 6)
+	// Read comma separated values, e.g. "5000,2000,1000"
+	const char *c = arg;
+	while (*c != '\0')
 	{
-		printf("Usage: ./calc_dxy linked_tracks.root title reco binWidth robustFactor\n");
-		return 1;
+		values.push_back(atof(c));
+		while (*c != '\0' && *c != ',')
+			c++;
+		if (*c == ',')
+			c++;
 	}
+}
 
-	TString filename_linked_tracks = argv[1];
-	TString title = argv[2];
-	double binWidth;
-	float robustFactor;
+int ParseInt(const char *arg, int &value)
+{
+	// Read a whole decimal number. Returns 1 if arg is empty or has other characters.
+	char *end;
+	value = strtol(arg, &end, 10);
+	return end == arg || *end != '\0';
+}
+
+void ParseZones(const char *arg, std::vector<int> &zones)
+{
+	// Read reco zones as comma separated numbers and ranges, e.g. "32", "1-9" or "1,5,7-9"
+	const char *c = arg;
+	while (*c != '\0')
+	{
+		int first = atoi(c), last = first;
+		while (*c != '\0' && *c != ',' && *c != '-')
+			c++;
+		if (*c == '-')
+		{
+			c++;
+			last = atoi(c);
+			while (*c != '\0' && *c != ',')
+				c++;
+		}
+		for (int reco = first; reco <= last; reco++)
+			zones.push_back(reco);
+		if (*c == ',')
+			c++;
+	}
+}
+
+// EdbDataProc is not known to be thread safe, so reading the tracks of a zone and writing the results of another
+// are serialized. Only the fit of a zone overlaps with the read of the next zone.
+std::mutex fedraMutex;
+
+// Tracks of one reco zone
+struct zoneTracks
+{
 	int reco;
-	sscanf(argv[3], "%d", &reco);
-	double Xcenter = (reco - 1) % 9 * 15000 + 5000;
-	double Ycenter = (reco - 1) / 9 * 15000 + 5000;
-	sscanf(argv[4], "%lf", &binWidth);
-	sscanf(argv[5], "%f", &robustFactor);
-
-	EdbDataProc *dproc = new EdbDataProc;
-	EdbPVRec *pvr = new EdbPVRec;
-	dproc->ReadTracksTree(*pvr, filename_linked_tracks, "1");
-
-	TObjArray *tracks = pvr->GetTracks();
-	int nPatterns = pvr->Npatterns();
+	double Xcenter, Ycenter;
+	EdbDataProc *dproc;
+	EdbPVRec *pvr;
+};
+
+void ReadZone(TString pattern, zoneTracks *z)
+{
+	// Read linked_tracks.root of a zone. The file name may contain the reco number and the zone center in printf format,
+	// e.g. ".../reco%02d_%06.0f_%06.0f/v15/linked_tracks.root".
+	TString filename = pattern.Contains("%") ? TString::Format(pattern.Data(), z->reco, z->Xcenter, z->Ycenter) : pattern;
+	std::lock_guard<std::mutex> lock(fedraMutex);
+	z->dproc = new EdbDataProc;
+	z->pvr = new EdbPVRec;
+	z->dproc->ReadTracksTree(*z->pvr, filename, "1");
+}
+
+void AlignZone(FnuDivideAlign &align, zoneTracks *z, TString title, const std::vector<double> &binWidths, const std::vector<double> &robustFactors,
+               bool sweep, bool multiZone)
+{
+	TObjArray *tracks = z->pvr->GetTracks();
+	int nPatterns = z->pvr->Npatterns();
 	int ntrk = tracks->GetEntriesFast();
 
 	if (ntrk == 0)
 	{
-		printf("ntrk==0\n");
-		return 0;
+		printf("reco%d: ntrk==0\n", z->reco);
+		return;
 	}
 
-	FnuDivideAlign align;
-	align.SetRobustFactor(robustFactor);
-	align.SetBinWidth(binWidth);
-	align.Align(tracks, Xcenter, Ycenter, nPatterns);
-	align.WriteAlignPar("align_output/alignPar_" + title + ".root");
-
 	TObjArray *tracks_t = new TObjArray;
 	for (int itrk = 0; itrk < ntrk; itrk++)
 	{
 		EdbTrackP *t = (EdbTrackP *)tracks->At(itrk);
 		tracks_t->Add(t);
 	}
-	dproc->MakeTracksTree(*tracks_t, 0, 0, Form("/data/Users/kokui/FASERnu/F222/zone4/temp/TFD/vert32063_pl053_167_new/reco32_065000_050000/v15/linked_tracks_after_align_binWidth%.0f_robustFactor%.1f.root", binWidth, robustFactor));
+
+	// Segment positions before alignment. Each configuration starts from them.
+	std::vector<float> x0, y0;
+	for (int itrk = 0; itrk < ntrk; itrk++)
+	{
+		EdbTrackP *t = (EdbTrackP *)tracks->At(itrk);
+		for (int iseg = 0; iseg < t->N(); iseg++)
+		{
+			x0.push_back(t->GetSegment(iseg)->X());
+			y0.push_back(t->GetSegment(iseg)->Y());
+		}
+	}
+
+	for (int ib = 0; ib < binWidths.size(); ib++)
+	{
+		for (int ir = 0; ir < robustFactors.size(); ir++)
+		{
+			double binWidth = binWidths[ib];
+			float robustFactor = robustFactors[ir];
+			int i = 0;
+			for (int itrk = 0; itrk < ntrk; itrk++)
+			{
+				EdbTrackP *t = (EdbTrackP *)tracks->At(itrk);
+				for (int iseg = 0; iseg < t->N(); iseg++, i++)
+				{
+					t->GetSegment(iseg)->SetX(x0[i]);
+					t->GetSegment(iseg)->SetY(y0[i]);
+				}
+			}
+
+			align.SetRobustFactor(robustFactor);
+			align.SetBinWidth(binWidth);
+			align.Align(tracks, z->Xcenter, z->Ycenter, nPatterns);
+			std::lock_guard<std::mutex> lock(fedraMutex);
+			TString name = title;
+			if (multiZone)
+				name += Form("_reco%d", z->reco);
+			if (sweep)
+				name += Form("_binWidth%.0f_robustFactor%.1f", binWidth, robustFactor);
+			align.WriteAlignPar("align_output/alignPar_" + name + ".root");
+			align.WriteAlignMap("align_output/alignMap_" + name + ".root");
+			z->dproc->MakeTracksTree(*tracks_t, 0, 0, Form("/data/Users/kokui/FASERnu/F222/zone4/temp/TFD/vert32063_pl053_167_new/reco%02d_%06.0f_%06.0f/v15/linked_tracks_after_align_binWidth%.0f_robustFactor%.1f.root", z->reco, z->Xcenter, z->Ycenter, binWidth, robustFactor));
+		}
+	}
+	delete tracks_t;
+}
+
+void PrintUsage()
+{
+	printf("Usage: ./divide_align linked_tracks.root title reco binWidth robustFactor [options]\n");
+	printf("  binWidth and robustFactor can be comma separated lists, e.g. 5000,2000 1.0,0.8.\n");
+	printf("  All pairs are aligned from the same tracks read once.\n");
+	printf("  reco can be a list of zones and ranges, e.g. 1-9 or 1,5,7-9. The tracks of the next zone are read\n");
+	printf("  while a zone is aligned. linked_tracks.root then contains the reco number and the zone center in printf\n");
+	printf("  format, e.g. .../reco%%02d_%%06.0f_%%06.0f/v15/linked_tracks.root, and outputs are named title_recoN.\n");
+	printf("  options: gpu|cpu|quad, num|grad|gradcheck|batchgrad, migrad|minuit2|lbfgs|gn, threads=N (0: all cores),\n");
+	printf("           pyramid=N (fit 2^(N-1)*binWidth tiles first and refine them),\n");
+	printf("           cache=DIR (reuse tile results stored in DIR),\n");
+	printf("           interp (interpolate the shifts between tile centers),\n");
+	printf("           plates=SIZE[,OVERLAP] (fit windows of SIZE >= 3 plates overlapping by OVERLAP plates),\n");
+	printf("           freeze=N[,STEP] (rank the tracks every N calls or when a shift moves STEP um, cpu and quad with grad),\n");
+	printf("           adaptive=N (with pyramid, refine only tiles with N track candidates),\n");
+	printf("           float (sum the track chi2 in float), noangle (chi2 of the positions only)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 6)
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	TString filename_linked_tracks = argv[1];
+	TString title = argv[2];
+	std::vector<int> zones;
+	ParseZones(argv[3], zones);
+	if (zones.empty())
+	{
+		printf("no reco zone in %s\n", argv[3]);
+		return 1;
+	}
+	bool multiZone = zones.size() > 1;
+	if (multiZone && !filename_linked_tracks.Contains("%"))
+	{
+		printf("%s does not contain the reco number of the zones\n", argv[1]);
+		return 1;
+	}
+	std::vector<double> binWidths, robustFactors;
+	ParseList(argv[4], binWidths);
+	ParseList(argv[5], robustFactors);
+	bool sweep = binWidths.size() * robustFactors.size() > 1;
+
+	FnuDivideAlign align;
+	bool modelFloat = false, modelAngle = true;
+	std::vector<double> freeze;
+	for (int iarg = 6; iarg < argc; iarg++)
+	{
+		TString option = argv[iarg];
+		int value;
+		int error = 0;
+		if (option == "cpu")
+			error = align.SetEngine(kAlignEngineCPU);
+		else if (option == "gpu")
+			error = align.SetEngine(kAlignEngineGPU);
+		else if (option == "quad")
+			error = align.SetEngine(kAlignEngineQuad);
+		else if (option == "num")
+			error = align.SetGradientMode(kGradientNumerical);
+		else if (option == "grad")
+			error = align.SetGradientMode(kGradientAnalytic);
+		else if (option == "gradcheck")
+			error = align.SetGradientMode(kGradientCheck);
+		else if (option == "batchgrad")
+			error = align.SetGradientMode(kGradientBatch);
+		else if (option == "migrad")
+			error = align.SetSolver(kSolverMigrad);
+		else if (option == "gn")
+			error = align.SetSolver(kSolverGaussNewton);
+		else if (option == "minuit2")
+			error = align.SetSolver(kSolverMinuit2);
+		else if (option == "lbfgs")
+			error = align.SetSolver(kSolverLBFGS);
+		else if (option.BeginsWith("threads=") && ParseInt(option.Data() + 8, value) == 0)
+			align.SetNThreads(value);
+		else if (option.BeginsWith("pyramid=") && ParseInt(option.Data() + 8, value) == 0)
+			align.SetPyramid(value);
+		else if (option.BeginsWith("adaptive=") && ParseInt(option.Data() + 9, value) == 0)
+			align.SetAdaptive(value);
+		else if (option.BeginsWith("plates="))
+		{
+			std::vector<double> window;
+			ParseList(option.Data() + 7, window);
+			if (window.empty())
+			{
+				PrintUsage();
+				return 1;
+			}
+			align.SetPlateWindows((int)window[0], window.size() > 1 ? (int)window[1] : 0);
+		}
+		else if (option.BeginsWith("freeze="))
+		{
+			freeze.clear();
+			ParseList(option.Data() + 7, freeze);
+			if (freeze.empty())
+			{
+				PrintUsage();
+				return 1;
+			}
+		}
+		else if (option == "float")
+			modelFloat = true;
+		else if (option == "noangle")
+			modelAngle = false;
+		else if (option == "interp")
+			align.SetInterpolation(true);
+		else if (option.BeginsWith("cache="))
+			error = align.SetCacheDirectory(option.Data() + 6);
+		else
+		{
+			// a misspelled option would otherwise run the default configuration
+			printf("Unknown option %s\n", argv[iarg]);
+			PrintUsage();
+			return 1;
+		}
+		if (error != 0)
+			return 1;
+	}
+
+	// after the gradient mode and the solver, which decide whether the freeze can be used
+	if (!freeze.empty() && align.SetInlierFreeze((int)freeze[0], freeze.size() > 1 ? freeze[1] : 1.0) != 0)
+		return 1;
+	if (modelFloat || !modelAngle)
+		align.SetModel(modelAngle ? (modelFloat ? kModelPosAngleFloat : kModelPosAngleDouble) : (modelFloat ? kModelPosFloat : kModelPosDouble));
+
+	// The next zone is read by another thread while the current one is aligned, see fedraMutex.
+	// The workers of align and the OpenMP threads are kept across zones.
+	if (multiZone)
+		ROOT::EnableThreadSafety();
+	std::vector<zoneTracks> zone(zones.size());
+	for (int iz = 0; iz < zones.size(); iz++)
+	{
+		zone[iz].reco = zones[iz];
+		zone[iz].Xcenter = (zones[iz] - 1) % 9 * 15000 + 5000;
+		zone[iz].Ycenter = (zones[iz] - 1) / 9 * 15000 + 5000;
+	}
+	ReadZone(filename_linked_tracks, &zone[0]);
+	for (int iz = 0; iz < zone.size(); iz++)
+	{
+		std::thread prefetch;
+		if (iz + 1 < zone.size())
+			prefetch = std::thread(ReadZone, filename_linked_tracks, &zone[iz + 1]);
+		if (multiZone)
+			printf("reco%d: Xcenter=%.0f Ycenter=%.0f\n", zone[iz].reco, zone[iz].Xcenter, zone[iz].Ycenter);
+		AlignZone(align, &zone[iz], title, binWidths, robustFactors, sweep, multiZone);
+		if (prefetch.joinable())
+			prefetch.join();
+		delete zone[iz].pvr;
+		delete zone[iz].dproc;
+	}
 
 	return 0;
-}
\ No newline at end of file
+}
@@ -7,6 +7,8 @@
 #include <TH1.h>
 #include <TGraphAsymmErrors.h>
 
+#include "FnuPlateIndex.h"
+
 int main(int argc , char *argv[]){
 	if(argc<3){
 		printf("Usage : ./efficiency linked_tracks.root title\n");
@@ -28,6 +30,8 @@ int main(int argc , char *argv[]){
 	TEfficiency *eachPlateEfficiency =0;
 	
 	int ntrk = pvr->Ntracks();
+	FnuPlateIndex plateIndex; // segments of the tracks by plate
+	plateIndex.Build(pvr);
 	double bins[] = {0, 0.01, 0.02, 0.03, 0.04, 0.05, 0.06, 0.07, 0.08, 0.09, 0.1, 0.11, 0.12, 0.13, 0.14, 0.15, 0.16, 0.17, 0.18, 0.19, 0.2, 0.25, 0.3, 0.35, 0.4, 0.45, 0.5};
 	int nbins = 26;
 	double bins_pm[] = {-0.5, -0.45, -0.4, -0.35, -0.3, -0.25, -0.2, -0.19, -0.18, -0.17, -0.16, -0.15, -0.14, -0.13, -0.12, -0.11, -0.10, -0.09, -0.08, -0.07, -0.06, -0.05, -0.04, -0.03, -0.02, -0.01, 0, 0.01, 0.02, 0.03, 0.04, 0.05, 0.06, 0.07, 0.08, 0.09, 0.1, 0.11, 0.12, 0.13, 0.14, 0.15, 0.16, 0.17, 0.18, 0.19, 0.2, 0.25, 0.3, 0.35, 0.4, 0.45, 0.5};
@@ -61,35 +65,22 @@ int main(int argc , char *argv[]){
 	double x1, y1, z1, x2, y2, z2;
 	for(int itrk=0; itrk<ntrk; itrk++){
 		EdbTrackP *t = pvr->GetTrack(itrk);
-		int nseg = t->N();
+		nseg = t->N();
 		for(int iPID=2;iPID<nPID-2;iPID++){
 			int iplate = pvr->GetPattern(iPID)->Plate();
-			int counts = 0;
-			hitsOnThePlate = 0;
-			W=0;
-			for(int iseg=0;iseg<nseg;iseg++){
-				EdbSegP *s = t->GetSegment(iseg);
-				
-				if(s->PID()==iPID-2||s->PID()==iPID+2) counts++;
-				if(s->PID()==iPID-1){
-					x1=s->X();
-					y1=s->Y();
-					z1=s->Z();
-					counts++;
-				}
-				if(s->PID()==iPID+1){
-					x2=s->X();
-					y2=s->Y();
-					z2=s->Z();
-					counts++;
-				}
-				if(s->PID()==iPID)
-				{
-					hitsOnThePlate=1;
-					W=s->W();
-				}
-			}
+			// segments on the plates iPID-2..iPID+2
+			EdbSegP *s[5];
+			int counts = plateIndex.Window(itrk, iPID, 2, s);
+			hitsOnThePlate = s[2]!=0;
+			W = s[2]!=0 ? s[2]->W() : 0;
+			counts -= hitsOnThePlate;
 			if(counts==4) {
+				x1=s[1]->X();
+				y1=s[1]->Y();
+				z1=s[1]->Z();
+				x2=s[3]->X();
+				y2=s[3]->Y();
+				z2=s[3]->Z();
 				TX=(x2-x1)/(z2-z1);
 				TY=(y2-y1)/(z2-z1);
 				angle = sqrt(TX*TX+TY*TY);
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <math.h>
+
+#include "FnuTrimmedSum.h"
+#include "FnuAlignModel.h"
+
+inline double FnuWallTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Wall time in seconds spent in the parts of the engine since ResetStats
+struct alignEngineStats
+{
+    int nEval;
+    int nEvalFrozen;    // evaluations with the frozen set of used tracks
+    double tLoad;       // LoadTile
+    double tTransfer;   // copies between host and device
+    double tKernel;     // chi2 of the tracks
+    double tTrimmedSum; // selection of the used tracks
+    double tGrad;       // gradient
+    float threshold;    // chi2 threshold of the trimmed sum in the last Eval
+};
+
+// Engines to evaluate the robust alignment objective
+enum FnuAlignEngineType
+{
+    kAlignEngineGPU = 0,
+    kAlignEngineCPU = 1,
+    kAlignEngineQuad = 2
+};
+
+// Segments of the tracks in a divided area in structure-of-arrays form.
+// Segments of track i are stored in [offset[i], offset[i+1]).
+struct alignTile
+{
+    int ntrk;
+    std::vector<int> offset;
+    std::vector<int> pid;
+    std::vector<float> x, y, z;
+    std::vector<float> tx_first8, ty_first8;
+
+    alignTile() : ntrk(0), offset(1, 0) {}
+    int NSeg() const { return offset[ntrk]; }
+    void Clear()
+    {
+        ntrk = 0;
+        offset.assign(1, 0);
+        pid.clear();
+        x.clear();
+        y.clear();
+        z.clear();
+        tx_first8.clear();
+        ty_first8.clear();
+    }
+    void AddSegment(int spid, float sx, float sy, float sz)
+    {
+        pid.push_back(spid);
+        x.push_back(sx);
+        y.push_back(sy);
+        z.push_back(sz);
+    }
+    // Close the track whose segments were added since the last call
+    void AddTrack(float tx, float ty)
+    {
+        tx_first8.push_back(tx);
+        ty_first8.push_back(ty);
+        offset.push_back(pid.size());
+        ntrk++;
+    }
+};
+
+class FnuAlignEngine
+{
+protected:
+    alignEngineStats stats;
+    int model; // FnuAlignModelType
+    // Set of used tracks kept between evaluations, see SetInlierFreeze
+    int freezeCalls;
+    double freezeStep;
+    int nSinceRank;
+    std::vector<int> inliers;
+    std::vector<double> inlierWeight; // weight of each track of the tile in the trimmed sum
+    std::vector<double> inlierP;      // shifts at which the tracks were ranked
+
+    // True if the stored set of used tracks is valid at p
+    bool Frozen(const double *p)
+    {
+        if (freezeCalls <= 0 || inlierP.empty() || nSinceRank >= freezeCalls)
+            return false;
+        for (int i = 0; i < (int)inlierP.size(); i++)
+        {
+            if (fabs(p[i] - inlierP[i]) > freezeStep)
+                return false;
+        }
+        nSinceRank++;
+        stats.nEvalFrozen++;
+        return true;
+    }
+    // Keep the tracks used by a full evaluation at p
+    void StoreInliers(const float *chi2, int ntrk, float threshold, double wequal, const double *p)
+    {
+        if (freezeCalls <= 0)
+            return;
+        inliers.clear();
+        inlierWeight.assign(ntrk, 0.0);
+        for (int i = 0; i < ntrk; i++)
+        {
+            if (chi2[i] < threshold)
+                inlierWeight[i] = 1.0;
+            else if (chi2[i] == threshold)
+                inlierWeight[i] = wequal;
+            if (inlierWeight[i] > 0)
+                inliers.push_back(i);
+        }
+        inlierP.assign(p, p + NPar());
+        nSinceRank = 0;
+    }
+
+public:
+    FnuAlignEngine() : model(kModelPosAngleDouble), freezeCalls(0), freezeStep(0), nSinceRank(0) { ResetStats(); }
+    virtual ~FnuAlignEngine() {}
+    // Residual model of the track chi2 (FnuAlignModelType)
+    virtual void SetModel(int m) { model = m; }
+    int GetModel() { return model; }
+    // Evaluate only the tracks used at the last ranking for up to ncalls evaluations,
+    // as long as no shift moved more than maxStep um from where they were ranked. ncalls = 0 ranks every time.
+    // The trimmed sum is a minimum over the sets of tracks, so a frozen set gives an upper bound of it.
+    // Only Eval uses the frozen set, EvalBatch always ranks.
+    void SetInlierFreeze(int ncalls, double maxStep)
+    {
+        freezeCalls = ncalls;
+        freezeStep = maxStep;
+        ReleaseInliers();
+    }
+    // Rank all tracks at the next evaluation
+    void ReleaseInliers() { inlierP.clear(); }
+    void ResetStats()
+    {
+        stats.nEval = 0;
+        stats.nEvalFrozen = 0;
+        stats.tLoad = stats.tTransfer = stats.tKernel = stats.tTrimmedSum = stats.tGrad = 0;
+        stats.threshold = 0;
+    }
+    const alignEngineStats &GetStats() { return stats; }
+    // Set the tracks of a divided area and the number of shifts nPar = nPID*2.
+    // All pid of the tile must be below nPID. The tile must be kept until the next call.
+    virtual void LoadTile(const alignTile *tile, int nPar) = 0;
+    // Sum of the lowest ntrk*robustFactor track chi2 for the shifts p[nPar].
+    // If grad is given, its derivative for the current set of used tracks is filled in grad[nPar].
+    virtual double Eval(const double *p, float robustFactor, double *grad = 0) = 0;
+    // Objective for nvec shift vectors p[nvec][nPar], filled in fval[nvec].
+    // Engines override this to read the segments of a track once for all vectors.
+    virtual void EvalBatch(const double *p, int nvec, float robustFactor, double *fval)
+    {
+        for (int v = 0; v < nvec; v++)
+            fval[v] = Eval(p + v * NPar(), robustFactor);
+    }
+    virtual int NPar() = 0;
+    virtual const char *GetName() = 0;
+};
+
+// Engines which evaluate the tracks of a tile on the host with OpenMP.
+// The trimmed sum, the frozen set of used tracks, the gradient and the batches are evaluated here,
+// and the engines give the chi2 of one track and its derivative.
+class FnuAlignEngineHost : public FnuAlignEngine
+{
+protected:
+    const alignTile *tile;
+    int nPar;
+    std::vector<float> chi2;
+    std::vector<float> work;
+    std::vector<double> gradSeg;
+    std::vector<float> chi2Batch;
+
+    // Keep the tile and size the buffers of the tracks
+    void SetTile(const alignTile *t, int n);
+    double EvalFrozen(const double *p, double *grad);
+    // chi2 of track itrk at the shifts p
+    virtual float TrackChi2(int itrk, const double *p) = 0;
+    // Derivative of w times the chi2 of track itrk with respect to the shifts of its segments, stored in gseg[2*iseg]
+    virtual void TrackGrad(int itrk, const double *p, double w, double *gseg) = 0;
+
+public:
+    FnuAlignEngineHost() : tile(0), nPar(0) {}
+    int NPar() { return nPar; }
+    double Eval(const double *p, float robustFactor, double *grad = 0);
+    void EvalBatch(const double *p, int nvec, float robustFactor, double *fval);
+};
+
+class FnuAlignEngineCPU : public FnuAlignEngineHost
+{
+private:
+    // kernels of the model
+    float (*trackChi2)(const alignTile *tile, int itrk, const double *p);
+    void (*trackGrad)(const alignTile *tile, int itrk, const double *p, double weight, double *gseg);
+
+    float TrackChi2(int itrk, const double *p) { return trackChi2(tile, itrk, p); }
+    void TrackGrad(int itrk, const double *p, double w, double *gseg) { trackGrad(tile, itrk, p, w, gseg); }
+
+public:
+    FnuAlignEngineCPU();
+    ~FnuAlignEngineCPU();
+    void LoadTile(const alignTile *t, int n);
+    void SetModel(int m);
+    const char *GetName() { return "CPU"; }
+};
+
+// The chi2 of a track is a quadratic function of the shifts u of its segments,
+// a*|r + (1-H)u|^2 + c*(e - s.u)^2 with the residuals r and the angle difference e at u = 0.
+// The forms are built once in LoadTile, so Eval does not refit the raw coordinates.
+class FnuAlignEngineQuad : public FnuAlignEngineHost
+{
+private:
+    // per segment, z relative to the mean z of the track and the residuals at u = 0
+    std::vector<double> zc, rx, ry;
+    // per track
+    std::vector<double> a, invA11, ex, ey, chi2Zero;
+
+    template <bool UseAngle>
+    float FormChi2(int itrk, const double *p);
+    template <bool UseAngle>
+    void FormGrad(int itrk, const double *p, double w, double *gseg);
+    // kernels of the model
+    float (FnuAlignEngineQuad::*formChi2)(int itrk, const double *p);
+    void (FnuAlignEngineQuad::*formGrad)(int itrk, const double *p, double w, double *gseg);
+
+    float TrackChi2(int itrk, const double *p) { return (this->*formChi2)(itrk, p); }
+    void TrackGrad(int itrk, const double *p, double w, double *gseg) { (this->*formGrad)(itrk, p, w, gseg); }
+
+public:
+    FnuAlignEngineQuad();
+    ~FnuAlignEngineQuad();
+    void LoadTile(const alignTile *t, int n);
+    void SetModel(int m);
+    const char *GetName() { return "Quad"; }
+};
+
+#ifndef FNU_NO_CUDA
+class FnuAlignEngineGPU : public FnuAlignEngine
+{
+private:
+    int ntrk, nseg, nPar;
+    int nParAlloc; // size of the parameter buffers
+    // device copy of alignTile
+    int *d_offset, *d_pid;
+    float *d_x, *d_y, *d_z, *d_tx, *d_ty;
+    double *h_params;
+    double *d_params;
+    float *h_chi2;
+    float *d_chi2;
+    float *d_select; // values near the threshold for the trimmed sum
+    double *h_grad;
+    double *d_grad;
+    double *d_gseg;   // derivative for each segment
+    int *d_pidOffset; // segments sorted by plate
+    int *d_pidSeg;
+    int *h_hist; // histogram to find the threshold of the trimmed sum
+    int *d_hist;
+    // buffers of EvalBatch for up to batchSize vectors
+    int batchSize;
+    double *d_paramsBatch;
+    float *d_chi2Batch;
+
+    void FreeTile();
+    trimmedSum TrimmedSum(const float *v, int k);
+
+public:
+    FnuAlignEngineGPU();
+    ~FnuAlignEngineGPU();
+    void LoadTile(const alignTile *t, int n);
+    int NPar() { return nPar; }
+    double Eval(const double *p, float robustFactor, double *grad = 0);
+    void EvalBatch(const double *p, int nvec, float robustFactor, double *fval);
+    const char *GetName() { return "GPU"; }
+};
+#endif
+
+// Create an engine of the given type. Returns 0 if the type is not built in.
+FnuAlignEngine *FnuCreateAlignEngine(int type);
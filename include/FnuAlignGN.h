@@ -0,0 +1,44 @@
+#pragma once
+
+#include <vector>
+
+#include "FnuAlignEngine.h"
+
+// Alignment of a tile by linear least squares.
+// For a fixed set of used tracks the trimmed chi2 is quadratic in the shifts, and x and y
+// separate into two problems with the same normal matrix. The matrix is banded because
+// a track only couples the plates it crosses. Solving it and re-selecting the
+// ntrk*robustFactor tracks with the lowest chi2 is repeated until the set does not change.
+class FnuAlignGN
+{
+private:
+    int maxIterations;
+    int nIterations;
+    double fval;
+    bool useAngle;
+    std::vector<double> chi2;
+    std::vector<float> work;
+    std::vector<double> weight;
+    std::vector<double> band; // lower band of the normal matrix, then its Cholesky factor
+    std::vector<double> rhsX, rhsY;
+    std::vector<int> keep; // plates which are not solved for
+    int bandWidth;
+
+    double TrackChi2(const alignTile *tile, int itrk, const double *p);
+    void AddTrack(const alignTile *tile, int itrk, double w);
+    int Cholesky(int n);
+    void SolveCholesky(int n, std::vector<double> &b);
+
+public:
+    FnuAlignGN();
+    void SetMaxIterations(int n) { maxIterations = n; }
+    // Residual model (FnuAlignModelType). The solver works in double, so only the angle term matters.
+    void SetModel(int model) { useAngle = FnuAlignModelUsesAngle(model); }
+    // Solve for p[nPID*2], starting from the tracks selected at the given p.
+    // Plates with fixed[pid] != 0 and plates without segments keep their value in p.
+    // The solved shifts are clamped to [low[i], high[i]], the bounds the minimizers are given.
+    // Returns 0 if the set of used tracks converged.
+    int Solve(const alignTile *tile, int nPID, const std::vector<int> &fixed, float robustFactor, const double *low, const double *high, double *p);
+    int GetNIterations() { return nIterations; }
+    double GetFval() { return fval; }
+};
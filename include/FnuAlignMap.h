@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+
+#include <TObjArray.h>
+#include <TString.h>
+#include <EdbPattern.h>
+
+// Shifts of all plates on the tile grid of FnuDivideAlign.
+// Tile (ix, iy) covers [Xmin + ix*binWidth, Xmin + (ix+1)*binWidth) and the same in y,
+// and its shifts are shift[(itile*nPID + pid)*2] and shift[(itile*nPID + pid)*2 + 1].
+// With adaptive tiling the shifts of a tile come from the fit of a tile of binWidth*2^level around it.
+class FnuAlignMap
+{
+private:
+    int nX, nY, nPID;
+    double Xmin, Ymin, binWidth;
+    std::vector<int> fitted;
+    std::vector<int> level;
+    std::vector<double> shift;
+
+public:
+    FnuAlignMap();
+    void Init(int nx, int ny, double xmin, double ymin, double bwidth, int npid);
+    int NX() const { return nX; }
+    int NY() const { return nY; }
+    int NPID() const { return nPID; }
+    double CenterX(int ix) const { return Xmin + binWidth / 2 + ix * binWidth; }
+    double CenterY(int iy) const { return Ymin + binWidth / 2 + iy * binWidth; }
+    int FindTile(double x, double y) const;
+    bool IsFitted(int itile) const { return fitted[itile] != 0; }
+    void SetShift(int itile, const double *p, int lev = 0);
+    int GetLevel(int itile) const { return level[itile]; }
+    const double *GetShift(int itile) const { return &shift[itile * nPID * 2]; }
+    // Shift at (x, y). Without interpolation it is the shift of the tile, or 0 outside the fitted tiles.
+    // With interpolation it is bilinear between the centers of the fitted tiles around (x, y).
+    void Shift(double x, double y, int pid, bool interpolate, double &dx, double &dy) const;
+    void ApplySegment(EdbSegP *s, bool interpolate) const;
+    // Shift all segments of the tracks in one pass
+    void Apply(TObjArray *tracks, bool interpolate) const;
+    void Write(TString filename) const;
+    int Read(TString filename);
+};
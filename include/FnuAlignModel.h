@@ -0,0 +1,183 @@
+#pragma once
+
+#ifdef __CUDACC__
+#define FNU_HOST_DEVICE __host__ __device__
+#else
+#define FNU_HOST_DEVICE
+#endif
+
+// Resolutions of the segment position (um^2) and of the track angle in the chi2 of a track
+struct alignResolution
+{
+    static constexpr double sigmaPos2 = 0.36; // 0.6 * 0.6;
+    static constexpr double sigmaAng2 = 4e-6; // 0.002 * 0.002;
+};
+
+// Residual model of the chi2 of a track as a compile-time policy.
+// Real is the type of all sums of the line fit and of the chi2. With UseAngle the difference
+// between the fitted slope and the angle of the first 8 segments is added.
+template <class Real, bool UseAngle, class Resolution = alignResolution>
+struct alignModel
+{
+    typedef Real real;
+    static constexpr bool useAngle = UseAngle;
+    static constexpr Real sigmaPos2 = Resolution::sigmaPos2;
+    static constexpr Real sigmaAng2 = Resolution::sigmaAng2;
+};
+
+// Models instantiated in the engines and selected at runtime by SetModel
+enum FnuAlignModelType
+{
+    kModelPosAngleDouble = 0,
+    kModelPosAngleFloat = 1,
+    kModelPosDouble = 2,
+    kModelPosFloat = 3
+};
+typedef alignModel<double, true> alignModelPosAngleDouble;
+typedef alignModel<float, true> alignModelPosAngleFloat;
+typedef alignModel<double, false> alignModelPosDouble;
+typedef alignModel<float, false> alignModelPosFloat;
+
+inline const char *FnuAlignModelName(int model)
+{
+    switch (model)
+    {
+    case kModelPosAngleDouble:
+        return "position+angle, double";
+    case kModelPosAngleFloat:
+        return "position+angle, float";
+    case kModelPosDouble:
+        return "position, double";
+    case kModelPosFloat:
+        return "position, float";
+    }
+    return "unknown";
+}
+
+// Call Launch<Model>::Run(args...) for the model selected at runtime
+template <template <class> class Launch, class... Args>
+inline void FnuDispatchModel(int model, Args... args)
+{
+    switch (model)
+    {
+    case kModelPosAngleFloat:
+        Launch<alignModelPosAngleFloat>::Run(args...);
+        break;
+    case kModelPosDouble:
+        Launch<alignModelPosDouble>::Run(args...);
+        break;
+    case kModelPosFloat:
+        Launch<alignModelPosFloat>::Run(args...);
+        break;
+    default:
+        Launch<alignModelPosAngleDouble>::Run(args...);
+    }
+}
+
+inline bool FnuAlignModelUsesAngle(int model)
+{
+    return model == kModelPosAngleDouble || model == kModelPosAngleFloat;
+}
+
+// Line fit x = x0 + tx*z of a track. Positions are taken relative to the first segment of the track,
+// including its shift, so that float sums do not lose the residuals in the absolute coordinates.
+template <class Model>
+struct trackFit
+{
+    typedef typename Model::real real;
+    int begin, end;
+    real A00, A01, det;
+    real x0, tx, y0, ty;
+};
+
+// Shifted position of segment i relative to segment b
+template <class Real>
+FNU_HOST_DEVICE inline Real FnuRelativePos(const float *s, const int *pid, const double *p, int i, int b, int xy)
+{
+    return (Real)(s[i] - s[b]) + (Real)(p[pid[i] * 2 + xy] - p[pid[b] * 2 + xy]);
+}
+
+template <class Model>
+FNU_HOST_DEVICE inline void FnuFitTrack(int itrk, const int *offset, const int *pid, const float *sx, const float *sy, const float *sz,
+                                        const double *p, trackFit<Model> &f)
+{
+    typedef typename Model::real real;
+    const int begin = offset[itrk];
+    const int end = offset[itrk + 1];
+    real A00 = end - begin, A01 = 0, A02 = 0, A11 = 0, A12 = 0;
+    real B02 = 0, B12 = 0;
+#pragma omp simd reduction(+ : A01, A02, A11, A12, B02, B12)
+    for (int i = begin; i < end; i++)
+    {
+        real x = FnuRelativePos<real>(sx, pid, p, i, begin, 0);
+        real y = FnuRelativePos<real>(sy, pid, p, i, begin, 1);
+        real z = sz[i] - sz[begin];
+        A01 += z;
+        A02 += x;
+        A11 += z * z;
+        A12 += z * x;
+        B02 += y;
+        B12 += z * y;
+    }
+    real det = A00 * A11 - A01 * A01;
+    f.begin = begin;
+    f.end = end;
+    f.A00 = A00;
+    f.A01 = A01;
+    f.det = det;
+    f.x0 = (A02 * A11 - A01 * A12) / det;
+    f.tx = (A00 * A12 - A01 * A02) / det;
+    f.y0 = (B02 * A11 - A01 * B12) / det;
+    f.ty = (A00 * B12 - A01 * B02) / det;
+}
+
+template <class Model>
+FNU_HOST_DEVICE inline float FnuTrackChi2(int itrk, const int *offset, const int *pid, const float *sx, const float *sy, const float *sz,
+                                          const float *tx_first8, const float *ty_first8, const double *p)
+{
+    // Calculate chi2 of a track after the fit by least square method
+    typedef typename Model::real real;
+    trackFit<Model> f;
+    FnuFitTrack<Model>(itrk, offset, pid, sx, sy, sz, p, f);
+    real chi2 = 0;
+#pragma omp simd reduction(+ : chi2)
+    for (int i = f.begin; i < f.end; i++)
+    {
+        real z = sz[i] - sz[f.begin];
+        real dx = FnuRelativePos<real>(sx, pid, p, i, f.begin, 0) - (f.x0 + f.tx * z);
+        real dy = FnuRelativePos<real>(sy, pid, p, i, f.begin, 1) - (f.y0 + f.ty * z);
+        chi2 += dx * dx + dy * dy;
+    }
+    chi2 /= Model::sigmaPos2 * (f.end - f.begin);
+    if (Model::useAngle)
+    {
+        real dtx = tx_first8[itrk] - f.tx;
+        real dty = ty_first8[itrk] - f.ty;
+        chi2 += (dtx * dtx + dty * dty) / Model::sigmaAng2;
+    }
+    return chi2;
+}
+
+template <class Model>
+FNU_HOST_DEVICE inline void FnuTrackGrad(int itrk, const int *offset, const int *pid, const float *sx, const float *sy, const float *sz,
+                                         const float *tx_first8, const float *ty_first8, const double *p, double weight, double *gseg)
+{
+    // Derivative of weight times the track chi2 with respect to the shifts of its segments, stored in gseg[2*iseg].
+    // The residual vector r = (1-H)x of a linear fit gives d(sum r^2)/dx_i = 2 r_i,
+    // and the fitted slope a1 = sum (A00*z_i - A01)/det * x_i.
+    typedef typename Model::real real;
+    trackFit<Model> f;
+    FnuFitTrack<Model>(itrk, offset, pid, sx, sy, sz, p, f);
+    real cPos = weight * 2 / (Model::sigmaPos2 * (f.end - f.begin));
+    real cAngX = Model::useAngle ? -weight * 2 * (tx_first8[itrk] - f.tx) / Model::sigmaAng2 / f.det : 0;
+    real cAngY = Model::useAngle ? -weight * 2 * (ty_first8[itrk] - f.ty) / Model::sigmaAng2 / f.det : 0;
+    for (int i = f.begin; i < f.end; i++)
+    {
+        real z = sz[i] - sz[f.begin];
+        real dx = FnuRelativePos<real>(sx, pid, p, i, f.begin, 0) - (f.x0 + f.tx * z);
+        real dy = FnuRelativePos<real>(sy, pid, p, i, f.begin, 1) - (f.y0 + f.ty * z);
+        real dslope = f.A00 * z - f.A01;
+        gseg[i * 2] = cPos * dx + cAngX * dslope;
+        gseg[i * 2 + 1] = cPos * dy + cAngY * dslope;
+    }
+}
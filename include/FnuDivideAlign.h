@@ -1,20 +1,124 @@
-#include <TVirtualFitter.h>
 #include <TObjArray.h>
 #include <EdbPattern.h>
 
-const int NPIDMAX = 800;
+#include "FnuAlignEngine.h"
+#include "FnuTileIndex.h"
+#include "FnuAlignGN.h"
+#include "FnuTileCache.h"
+#include "FnuAlignMap.h"
+#include "FnuMinimizer.h"
+
+// How derivatives of the objective are given to Minuit
+enum FnuAlignGradientMode
+{
+    kGradientNumerical = 0,
+    kGradientAnalytic = 1,
+    kGradientCheck = 2,
+    kGradientBatch = 3
+};
+
+// How the shifts of a tile are found
+enum FnuAlignSolver
+{
+    kSolverMigrad = 0,
+    kSolverGaussNewton = 1,
+    kSolverMinuit2 = 2,
+    kSolverLBFGS = 3
+};
+
+// Residuals of the middle segment of 5 consecutive plates from the line through the other 4,
+// as the deltaXY of FnuQualityCheck, for the tracks of one tile. Residuals beyond 2 um are not used.
+struct alignTileQuality
+{
+    int n;
+    double meanX, meanY;
+    double sigmaX, sigmaY; // RMS
+};
+
+// Telemetry of the fit of one tile. Times are wall times in seconds.
+struct alignTileStat
+{
+    int level;
+    double iX, iY;
+    int ntrk, nseg;
+    double cost; // estimated cost which orders the tiles of a level
+    int cached; // 1 if the result was read from the cache
+    int solver; // FnuAlignSolver
+    int ncall;  // FCN calls of the minimizer or Gauss-Newton iterations
+    int nGradCall, nIter; // calls with the gradient and iterations of the minimizer
+    int nEval, nEvalFrozen; // evaluations by the engine, and those with a frozen set of used tracks
+    int status;
+    double fval;
+    float threshold; // chi2 threshold of the used tracks at the last evaluation
+    double tSetup;   // filling the tile and loading it to the engine
+    double tTransfer, tKernel, tTrimmedSum, tGrad;
+    double tMinimizer; // rest of the fit, spent in the minimizer itself
+    double tMinimize;  // FnuMinimizer::Minimize or FnuAlignGN::Solve, including the evaluations, to compare the solvers
+    double tTotal;
+    alignTileQuality before, after; // residuals without and with the shifts of the tile
+};
+
+// Everything needed to fit one tile. Tiles fitted at the same time use separate workers.
+class FnuAlignWorker : public FnuMinimizerFunction {
+    public:
+        FnuAlignEngine *engine;
+        FnuMinimizer *minimizer;
+        FnuAlignGN gn;
+        alignTile tile;
+        alignTile windowTile; // segments of the plates of one window
+        float robustFactor;
+        int nParams;
+        int ncall;
+        int nGradCall, nIter;
+        double tMinimize;
+        // result of the last FitTile
+        int status;
+        double fval;
+        // central differences of the free parameters by EvalBatch instead of the analytic gradient
+        bool batchGradient;
+        std::vector<int> freePar;
+        std::vector<double> batchParams, batchFval;
+        // shifts and gradient for the gradient check and the stencil, nParams each
+        std::vector<double> params;
+        std::vector<double> grad;
+
+        FnuAlignWorker(int engineType, int minimizerType, int nPar);
+        ~FnuAlignWorker();
+        double Eval(const double *p, double *g);
+        double EvalStencil(double *g);
+};
 
 class FnuDivideAlign {
     private:
         double binWidth;
         TTree *alignPar;
-        TVirtualFitter *minuit;
-        double p[NPIDMAX*2];
+        TTree *alignStat;
+        std::vector<alignTileStat> tileStats;
+        std::vector<double> p;
         int nPID;
         double rangeXY;
+        float robustFactor;
+        int engineType;
+        FnuTileIndex index;
+        int gradientMode;
+        int solver;
+        int nThreads;
+        int pyramidLevels;
+        double pyramidWindow;
+        std::vector<FnuAlignWorker*> workers;
+        FnuTileCache cache;
+        FnuAlignMap map;
+        bool interpolate;
+        int plateWindow, plateOverlap, maxSweeps;
+        double sweepTolerance;
+        int freezeCalls;
+        double freezeStep;
+        int adaptiveTracks;
+        int residualModel;
         // values for TTree
-        double iXBranchValue, iYBranchValue, shiftXBranchValue, shiftYBranchValue;
+        double iXBranchValue, iYBranchValue, shiftXBranchValue, shiftYBranchValue, widthBranchValue;
         int pidBranchValue;
+        alignTileStat statBranchValue;
 
     public:
         FnuDivideAlign();
@@ -23,9 +127,42 @@ class FnuDivideAlign {
         void SetRobustFactor(float rfactor);
         double GetBinWidth();
         float GetRobustFactor();
+        int SetEngine(int type);
+        int GetEngine();
+        int SetGradientMode(int mode);
+        int GetGradientMode();
+        int SetSolver(int s);
+        int GetSolver();
+        static int MinimizerType(int s);
+        static bool UsesStencil(int mode, int s);
+        static const char *SolverName(int s);
+        void SetNThreads(int n);
+        int GetNThreads();
+        void SetPyramid(int levels, double window = 10);
+        int GetPyramidLevels();
+        int SetCacheDirectory(const char *dir);
+        void SetPlateWindows(int size, int overlap, int sweeps = 10);
+        int SetInlierFreeze(int ncalls, double maxStep = 1.0);
+        void SetAdaptive(int ntrk);
+        void SetModel(int model);
+        int GetModel();
+        void SetInterpolation(bool flag);
+        const FnuAlignMap &GetAlignMap() { return map; }
+        void CreateWorkers();
+        void DeleteWorkers();
         void CalcAlignPar(TObjArray *tracks,double iX, double iY, int fixflag);
+        void FitTile(FnuAlignWorker *w, double iX, double iY, int fixflag, double *par, const double *seed = 0);
+        void FitLevel(int level, const FnuTileIndex *parent, const std::vector<double> &parentShift, const std::vector<int> &parentFitted,
+                      std::vector<double> &shift, std::vector<int> &fitted);
+        void Minimize(FnuAlignWorker *w, const alignTile *t, const std::vector<int> &fixed, double *par, const double *seed);
+        void FitPlateWindows(FnuAlignWorker *w, const std::vector<int> &fixed, double *par, const double *seed);
+        void CheckGradient(FnuAlignWorker *w, const double *par);
+        void CalcTileQuality(const alignTile &t, const double *par, alignTileQuality &q);
         int CountPassedSeg(EdbTrackP *t, double iX, double iY);
         void ApplyAlign(EdbTrackP *t, double iX, double iY);
         int Align(TObjArray *tracks,double Xcenter, double Ycenter,int nPatterns);
+        void FillAlignStat();
+        const std::vector<alignTileStat> &GetTileStats() { return tileStats; }
         void WriteAlignPar(TString filename = "alignPar.root");
+        void WriteAlignMap(TString filename = "alignMap.root");
 };
\ No newline at end of file
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <vector>
+
+class TVirtualFitter;
+namespace ROOT
+{
+namespace Math
+{
+class Minimizer;
+}
+}
+
+// Objective minimized by FnuMinimizer
+class FnuMinimizerFunction
+{
+public:
+    virtual ~FnuMinimizerFunction() {}
+    // Value at p. If g is given, the gradient is filled in g.
+    virtual double Eval(const double *p, double *g) = 0;
+};
+
+// Calls and wall time of the last Minimize
+struct minimizerStats
+{
+    int nCall;        // evaluations of the function
+    int nGradCall;    // evaluations which also filled the gradient
+    int nIter;        // iterations of the minimizer, 0 for Minuit which does not report them
+    double tMinimize; // Minimize, including the evaluations
+};
+
+enum FnuMinimizerType
+{
+    kMinimizerMinuit = 0,
+    kMinimizerMinuit2 = 1,
+    kMinimizerLBFGS = 2
+};
+
+class FnuMinimizer
+{
+protected:
+    int nPar;
+    std::vector<double> value, step, low, high;
+    std::vector<double> result;
+    double fval;
+    bool useGradient;
+    int maxCalls;
+    double tolerance;
+    minimizerStats stats;
+    FnuMinimizerFunction *function;
+
+    // Minimize from value into result and fval. Returns 0 if it converged.
+    virtual int DoMinimize() = 0;
+
+public:
+    FnuMinimizer(int n);
+    virtual ~FnuMinimizer() {}
+    int NPar() { return nPar; }
+    void SetFunction(FnuMinimizerFunction *f) { function = f; }
+    // Parameter i starts at v and stays within [lo, hi]. step == 0 fixes it at v.
+    void SetParameter(int i, double v, double st, double lo, double hi);
+    bool IsFixed(int i) { return step[i] == 0; }
+    // Use the gradient of the function instead of finite differences by the minimizer
+    void SetGradient(bool flag) { useGradient = flag; }
+    // Backends which need the gradient of the function even without SetGradient
+    virtual bool RequiresGradient() { return false; }
+    void SetMaxCalls(int n) { maxCalls = n; }
+    // Same meaning as the tolerance of MIGRAD: stop when the estimated distance to the minimum is below 0.002*tol
+    void SetTolerance(double tol) { tolerance = tol; }
+    // Evaluate the function and count the call
+    double Call(const double *p, double *g);
+    // Returns 0 if the minimization converged
+    int Minimize();
+    double GetParameter(int i) { return result[i]; }
+    double GetFval() { return fval; }
+    const minimizerStats &GetStats() { return stats; }
+    virtual const char *GetName() = 0;
+};
+
+// MIGRAD of TMinuit through TFitter, one instance per minimizer
+class FnuMinimizerMinuit : public FnuMinimizer
+{
+private:
+    TVirtualFitter *minuit;
+
+    int DoMinimize();
+
+public:
+    FnuMinimizerMinuit(int n);
+    ~FnuMinimizerMinuit();
+    const char *GetName() { return "Minuit"; }
+};
+
+// Migrad of Minuit2 through ROOT::Math::Minimizer
+class FnuMinimizerMinuit2 : public FnuMinimizer
+{
+private:
+    ROOT::Math::Minimizer *minuit2;
+
+    int DoMinimize();
+
+public:
+    FnuMinimizerMinuit2(int n);
+    ~FnuMinimizerMinuit2();
+    bool IsAvailable() { return minuit2 != 0; }
+    const char *GetName() { return "Minuit2"; }
+};
+
+// Limited memory BFGS with bounds. The direction of the free parameters is given by the last
+// nHistory steps, parameters at a bound whose gradient points outside are held, and trial points
+// are projected into the bounds. Without SetGradient the function must still fill the gradient.
+class FnuMinimizerLBFGS : public FnuMinimizer
+{
+private:
+    int nHistory;
+    std::vector<std::vector<double>> s, y; // last steps and gradient changes, oldest first
+    std::vector<double> x, g, xNew, gNew, d, alpha;
+
+    int DoMinimize();
+    void Direction(const std::vector<int> &active);
+    double Project(int i, double v) { return v < low[i] ? low[i] : (v > high[i] ? high[i] : v); }
+
+public:
+    FnuMinimizerLBFGS(int n, int history = 10);
+    bool RequiresGradient() { return true; }
+    const char *GetName() { return "L-BFGS"; }
+};
+
+// Create a minimizer of the given type for n parameters. Returns 0 if the type is not built in.
+FnuMinimizer *FnuCreateMinimizer(int type, int n);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <vector>
+
+#include <EdbPattern.h>
+
+// Segments of each track by plate, so that a window of plates is read without scanning the track.
+// The plates from the first to the last plate of a track are stored densely, 0 where the track has no segment.
+// If a track has several segments on a plate, the last one is kept.
+class FnuPlateIndex
+{
+private:
+    std::vector<int> first;  // first pid of each track
+    std::vector<int> offset; // plates of track i are in [offset[i], offset[i+1])
+    std::vector<EdbSegP *> seg;
+
+public:
+    void Build(EdbPVRec *pvr)
+    {
+        int ntrk = pvr->Ntracks();
+        first.assign(ntrk, 0);
+        offset.assign(ntrk + 1, 0);
+        for (int itrk = 0; itrk < ntrk; itrk++)
+        {
+            EdbTrackP *t = pvr->GetTrack(itrk);
+            int pidMin = 0, pidMax = -1;
+            for (int iseg = 0; iseg < t->N(); iseg++)
+            {
+                int pid = t->GetSegment(iseg)->PID();
+                if (iseg == 0 || pid < pidMin)
+                    pidMin = pid;
+                if (iseg == 0 || pid > pidMax)
+                    pidMax = pid;
+            }
+            first[itrk] = pidMin;
+            offset[itrk + 1] = offset[itrk] + pidMax - pidMin + 1;
+        }
+        seg.assign(offset[ntrk], 0);
+        for (int itrk = 0; itrk < ntrk; itrk++)
+        {
+            EdbTrackP *t = pvr->GetTrack(itrk);
+            for (int iseg = 0; iseg < t->N(); iseg++)
+            {
+                EdbSegP *s = t->GetSegment(iseg);
+                seg[offset[itrk] + s->PID() - first[itrk]] = s;
+            }
+        }
+    }
+    // Segment of track itrk on plate pid, 0 if there is none
+    EdbSegP *Segment(int itrk, int pid) const
+    {
+        int i = pid - first[itrk];
+        if (i < 0 || i >= offset[itrk + 1] - offset[itrk])
+            return 0;
+        return seg[offset[itrk] + i];
+    }
+    // Number of the plates iPID-half..iPID+half with a segment, which are filled in s[2*half+1]
+    int Window(int itrk, int iPID, int half, EdbSegP **s) const
+    {
+        int count = 0;
+        for (int k = 0; k <= 2 * half; k++)
+        {
+            s[k] = Segment(itrk, iPID - half + k);
+            if (s[k] != 0)
+                count++;
+        }
+        return count;
+    }
+};
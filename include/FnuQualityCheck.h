@@ -1,6 +1,8 @@
 #include <EdbDataSet.h>
 #include <TEfficiency.h>
 
+#include "FnuPlateIndex.h"
+
 class FnuQualityCheck
 {
 private:
@@ -28,6 +30,7 @@ private:
     TH1I *nplHist;
     TH1I *firstPlateHist;
     TH1I *lastPlateHist;
+    FnuPlateIndex plateIndex; // segments of the tracks by plate, built in the constructor
 
     // variables for TTree
     int plate;
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "FnuAlignEngine.h"
+
+// Result of a tile fit
+struct tileResult
+{
+    int nPar;
+    int status;
+    int ncall;
+    double fval;
+    std::vector<double> p;
+};
+
+// Tile results stored in a directory, one file per tile.
+// The key is a hash of the segments of the tile and the fit settings, so a result is
+// reused whenever the same tile is fitted again with the same settings.
+class FnuTileCache
+{
+private:
+    std::string dir;
+
+public:
+    FnuTileCache();
+    // Use dir as cache. An empty dir disables the cache. Returns 1 if dir cannot be created.
+    int SetDirectory(const char *d);
+    bool IsEnabled() { return !dir.empty(); }
+    static unsigned long long Key(const alignTile &tile, const double *seed, int nPar, const char *settings);
+    int Load(unsigned long long key, tileResult &r);
+    void Store(unsigned long long key, const tileResult &r);
+};
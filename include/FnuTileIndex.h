@@ -0,0 +1,41 @@
+#pragma once
+
+#include <vector>
+
+#include <TObjArray.h>
+#include <EdbPattern.h>
+
+#include "FnuAlignEngine.h"
+
+// Segments bucketed into the binWidth*binWidth grid of FnuDivideAlign,
+// built once per Align() with the track preselection.
+class FnuTileIndex
+{
+private:
+    int nX, nY;
+    double Xmin, Ymin;
+    double binWidth;
+    // segments in each tile, grouped by track in track order
+    std::vector<int> segOffset;
+    std::vector<EdbSegP *> segs;
+    // preselected tracks with enough segments in each tile, as ranges of segs
+    std::vector<int> candOffset;
+    std::vector<int> candBegin, candEnd;
+    std::vector<EdbTrackP *> candTrack;
+
+public:
+    FnuTileIndex();
+    void Build(TObjArray *tracks, double Xcenter, double Ycenter, double rangeXY, double bwidth, int merge = 1);
+    int NX() { return nX; }
+    int NY() { return nY; }
+    int NTiles() { return nX * nY; }
+    double BinWidth() const { return binWidth; }
+    int Tile(int ix, int iy) const { return ix + iy * nX; }
+    double CenterX(int ix) const { return Xmin + binWidth / 2 + ix * binWidth; }
+    double CenterY(int iy) const { return Ymin + binWidth / 2 + iy * binWidth; }
+    int FindTile(double x, double y) const;
+    int NCandidates(int itile) { return candOffset[itile + 1] - candOffset[itile]; }
+    int NCandidateSegments(int itile);
+    double EstimateCost(int itile);
+    void FillTile(int itile, alignTile &tile);
+};
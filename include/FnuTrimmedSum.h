@@ -0,0 +1,56 @@
+#pragma once
+
+#include <algorithm>
+
+// The robust objective of a tile is the sum of the chi2 of the nrobust = ntrk*robustFactor tracks with the
+// lowest chi2, e.g. robustFactor = 0.5 uses 50% of the tracks. Only the nrobust lowest values are needed,
+// which selection gives in linear time instead of a full sort. The gradient is the sum over the same tracks,
+// where the tracks at the threshold share the remaining weight WeightEqual so that exactly nrobust tracks count.
+inline int FnuRobustCount(int ntrk, float robustFactor)
+{
+    return ntrk * robustFactor;
+}
+
+// Sum of the k lowest values of an array
+struct trimmedSum
+{
+    double sum;      // sum of the k lowest values
+    float threshold; // k-th lowest value
+    int nbelow;      // number of values < threshold
+    int nequal;      // number of values == threshold
+
+    // Weight of each value equal to the threshold, so that exactly k values are used
+    double WeightEqual(int k) const { return nequal > 0 ? (double)(k - nbelow) / nequal : 0; }
+};
+
+// Linear time on average. v[0..n) is reordered. FnuAlignEngineGPU::TrimmedSum is the same on device.
+inline trimmedSum FnuTrimmedSumHost(float *v, int n, int k)
+{
+    trimmedSum r;
+    r.sum = 0;
+    r.threshold = 0;
+    r.nbelow = 0;
+    r.nequal = 0;
+    if (k <= 0 || n <= 0)
+        return r;
+    if (k > n)
+        k = n;
+    std::nth_element(v, v + k - 1, v + n);
+    r.threshold = v[k - 1];
+    // values before k-1 are <= threshold and values after are >= threshold
+    for (int i = 0; i < k - 1; i++)
+    {
+        if (v[i] < r.threshold)
+        {
+            r.sum += v[i];
+            r.nbelow++;
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        if (v[i] == r.threshold)
+            r.nequal++;
+    }
+    r.sum += (double)(k - r.nbelow) * r.threshold;
+    return r;
+}
@@ -6,6 +6,20 @@ divide_align() {
 export -f divide_align
 # parallel -j 5 -u divide_align ::: 5000 2000 1000 500 ::: 1.0 0.{6..9}
 
+# same sweep in one process, the tracks are read only once
+divide_align_sweep() {
+    data="/data/FASER/F222/zone4/temp/TFD/vert32063_pl053_167_new/reco32_065000_050000/v15/linked_tracks.root"
+    ./divide_align ${data} sweep 32 5000,2000,1000,500 1.0,0.9,0.8,0.7,0.6 threads=0
+}
+# divide_align_sweep
+
+# all zones of the module in one process, the next zone is read while a zone is aligned
+divide_align_zones() {
+    data="/data/FASER/F222/zone4/temp/TFD/vert32063_pl053_167_new/reco%02d_%06.0f_%06.0f/v15/linked_tracks.root"
+    ./divide_align ${data} zones 1-45 ${1} ${2} threads=0
+}
+# divide_align_zones 5000 0.8
+
 measure_momentum() {
     # data="/data/FASER/F222/zone4/temp/TFD/vert32063_pl053_167_new/reco32_065000_050000/v15/linked_tracks.root"
     # ./measure_momentum ${data} before_align_${1} "npl>=100&&Entry$%5=="${1}
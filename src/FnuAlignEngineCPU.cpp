@@ -0,0 +1,55 @@
+#include "FnuAlignEngine.h"
+
+FnuAlignEngineCPU::FnuAlignEngineCPU()
+{
+	SetModel(kModelPosAngleDouble);
+}
+
+FnuAlignEngineCPU::~FnuAlignEngineCPU()
+{
+}
+
+void FnuAlignEngineCPU::LoadTile(const alignTile *t, int n)
+{
+	// Segments are read in place
+	SetTile(t, n);
+}
+
+template <class Model>
+static float CalcTrackChi2(const alignTile *tile, int itrk, const double *p)
+{
+	// Same calculation as calc_chi2_kernel for one track.
+	return FnuTrackChi2<Model>(itrk, &tile->offset[0], &tile->pid[0], &tile->x[0], &tile->y[0], &tile->z[0], &tile->tx_first8[0], &tile->ty_first8[0], p);
+}
+
+template <class Model>
+static void CalcTrackGrad(const alignTile *tile, int itrk, const double *p, double weight, double *gseg)
+{
+	// Same calculation as calc_grad_kernel for one track.
+	FnuTrackGrad<Model>(itrk, &tile->offset[0], &tile->pid[0], &tile->x[0], &tile->y[0], &tile->z[0], &tile->tx_first8[0], &tile->ty_first8[0], p, weight, gseg);
+}
+
+void FnuAlignEngineCPU::SetModel(int m)
+{
+	// The kernels of the model are instantiated at compile time and selected here
+	model = m;
+	switch (model)
+	{
+	case kModelPosAngleFloat:
+		trackChi2 = CalcTrackChi2<alignModelPosAngleFloat>;
+		trackGrad = CalcTrackGrad<alignModelPosAngleFloat>;
+		break;
+	case kModelPosDouble:
+		trackChi2 = CalcTrackChi2<alignModelPosDouble>;
+		trackGrad = CalcTrackGrad<alignModelPosDouble>;
+		break;
+	case kModelPosFloat:
+		trackChi2 = CalcTrackChi2<alignModelPosFloat>;
+		trackGrad = CalcTrackGrad<alignModelPosFloat>;
+		break;
+	default:
+		model = kModelPosAngleDouble;
+		trackChi2 = CalcTrackChi2<alignModelPosAngleDouble>;
+		trackGrad = CalcTrackGrad<alignModelPosAngleDouble>;
+	}
+}
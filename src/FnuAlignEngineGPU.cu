@@ -0,0 +1,423 @@
+#include "FnuAlignEngine.h"
+#include "FnuTrimmedSum.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include <cuda_runtime.h>
+#include <helper_cuda.h>
+#include <thrust/copy.h>
+#include <thrust/extrema.h>
+#include <thrust/transform_reduce.h>
+#include <thrust/functional.h>
+#include <thrust/execution_policy.h>
+
+const int NHISTBIN = 1024;
+// Values left in the selected bin are copied to host when there are this many or fewer
+const int NSELECTHOST = 4096;
+
+FnuAlignEngineGPU::FnuAlignEngineGPU()
+	: ntrk(0), nseg(0), nPar(0), nParAlloc(0), h_params(0), d_params(0), h_grad(0), d_grad(0), d_offset(0), d_pid(0), d_x(0), d_y(0), d_z(0), d_tx(0), d_ty(0), h_chi2(0), d_chi2(0), d_select(0),
+	  batchSize(0), d_paramsBatch(0), d_chi2Batch(0)
+{
+	checkCudaErrors(cudaMallocHost((void **)&h_hist, sizeof(int) * NHISTBIN));
+	checkCudaErrors(cudaMalloc((void **)&d_hist, sizeof(int) * NHISTBIN));
+}
+
+FnuAlignEngineGPU::~FnuAlignEngineGPU()
+{
+	FreeTile();
+	checkCudaErrors(cudaFreeHost(h_params));
+	checkCudaErrors(cudaFree(d_params));
+	checkCudaErrors(cudaFreeHost(h_grad));
+	checkCudaErrors(cudaFree(d_grad));
+	checkCudaErrors(cudaFreeHost(h_hist));
+	checkCudaErrors(cudaFree(d_hist));
+	checkCudaErrors(cudaFree(d_paramsBatch));
+	checkCudaErrors(cudaFree(d_chi2Batch));
+}
+
+void FnuAlignEngineGPU::FreeTile()
+{
+	if (d_offset == 0)
+		return;
+	checkCudaErrors(cudaFreeHost(h_chi2));
+	checkCudaErrors(cudaFree(d_chi2));
+	checkCudaErrors(cudaFree(d_select));
+	checkCudaErrors(cudaFree(d_offset));
+	checkCudaErrors(cudaFree(d_pid));
+	checkCudaErrors(cudaFree(d_x));
+	checkCudaErrors(cudaFree(d_y));
+	checkCudaErrors(cudaFree(d_z));
+	checkCudaErrors(cudaFree(d_tx));
+	checkCudaErrors(cudaFree(d_ty));
+	checkCudaErrors(cudaFree(d_gseg));
+	checkCudaErrors(cudaFree(d_pidOffset));
+	checkCudaErrors(cudaFree(d_pidSeg));
+	checkCudaErrors(cudaFree(d_chi2Batch));
+	d_chi2Batch = 0;
+	batchSize = 0;
+	d_offset = 0;
+	ntrk = nseg = 0;
+}
+
+void FnuAlignEngineGPU::LoadTile(const alignTile *tile, int n)
+{
+	// Cuda data buffers, sized by the segments which exist in the tile
+	double t0 = FnuWallTime();
+	FreeTile();
+	ntrk = tile->ntrk;
+	nseg = tile->NSeg();
+	nPar = n;
+	int npid = nPar / 2;
+	if (nPar > nParAlloc)
+	{
+		// parameter buffers are kept between tiles and only grow
+		checkCudaErrors(cudaFreeHost(h_params));
+		checkCudaErrors(cudaFree(d_params));
+		checkCudaErrors(cudaFreeHost(h_grad));
+		checkCudaErrors(cudaFree(d_grad));
+		checkCudaErrors(cudaMallocHost((void **)&h_params, sizeof(double) * nPar));
+		checkCudaErrors(cudaMalloc((void **)&d_params, sizeof(double) * nPar));
+		checkCudaErrors(cudaMallocHost((void **)&h_grad, sizeof(double) * nPar));
+		checkCudaErrors(cudaMalloc((void **)&d_grad, sizeof(double) * nPar));
+		nParAlloc = nPar;
+	}
+	checkCudaErrors(cudaMallocHost((void **)&h_chi2, sizeof(float) * ntrk));
+	checkCudaErrors(cudaMalloc((void **)&d_chi2, sizeof(float) * ntrk));
+	checkCudaErrors(cudaMalloc((void **)&d_select, sizeof(float) * ntrk));
+	checkCudaErrors(cudaMalloc((void **)&d_offset, sizeof(int) * (ntrk + 1)));
+	checkCudaErrors(cudaMalloc((void **)&d_tx, sizeof(float) * ntrk));
+	checkCudaErrors(cudaMalloc((void **)&d_ty, sizeof(float) * ntrk));
+	checkCudaErrors(cudaMalloc((void **)&d_pid, sizeof(int) * nseg));
+	checkCudaErrors(cudaMalloc((void **)&d_x, sizeof(float) * nseg));
+	checkCudaErrors(cudaMalloc((void **)&d_y, sizeof(float) * nseg));
+	checkCudaErrors(cudaMalloc((void **)&d_z, sizeof(float) * nseg));
+	checkCudaErrors(cudaMalloc((void **)&d_gseg, sizeof(double) * nseg * 2));
+	checkCudaErrors(cudaMalloc((void **)&d_pidOffset, sizeof(int) * (npid + 1)));
+	checkCudaErrors(cudaMalloc((void **)&d_pidSeg, sizeof(int) * nseg));
+
+	checkCudaErrors(cudaMemcpy(d_offset, &tile->offset[0], sizeof(int) * (ntrk + 1), cudaMemcpyHostToDevice));
+	checkCudaErrors(cudaMemcpy(d_tx, &tile->tx_first8[0], sizeof(float) * ntrk, cudaMemcpyHostToDevice));
+	checkCudaErrors(cudaMemcpy(d_ty, &tile->ty_first8[0], sizeof(float) * ntrk, cudaMemcpyHostToDevice));
+	checkCudaErrors(cudaMemcpy(d_pid, &tile->pid[0], sizeof(int) * nseg, cudaMemcpyHostToDevice));
+	checkCudaErrors(cudaMemcpy(d_x, &tile->x[0], sizeof(float) * nseg, cudaMemcpyHostToDevice));
+	checkCudaErrors(cudaMemcpy(d_y, &tile->y[0], sizeof(float) * nseg, cudaMemcpyHostToDevice));
+	checkCudaErrors(cudaMemcpy(d_z, &tile->z[0], sizeof(float) * nseg, cudaMemcpyHostToDevice));
+
+	// Segments sorted by plate, to sum the gradient without atomics
+	std::vector<int> pidOffset(npid + 1, 0);
+	std::vector<int> pidSeg(nseg);
+	for (int i = 0; i < nseg; i++)
+		pidOffset[tile->pid[i] + 1]++;
+	for (int ipid = 0; ipid < npid; ipid++)
+		pidOffset[ipid + 1] += pidOffset[ipid];
+	std::vector<int> fill(pidOffset.begin(), pidOffset.end() - 1);
+	for (int i = 0; i < nseg; i++)
+		pidSeg[fill[tile->pid[i]]++] = i;
+	checkCudaErrors(cudaMemcpy(d_pidOffset, &pidOffset[0], sizeof(int) * (npid + 1), cudaMemcpyHostToDevice));
+	checkCudaErrors(cudaMemcpy(d_pidSeg, &pidSeg[0], sizeof(int) * nseg, cudaMemcpyHostToDevice));
+	stats.tLoad += FnuWallTime() - t0;
+}
+
+template <class Model>
+__global__ void calc_chi2_kernel(int n, const int *offset, const int *pid, const float *sx, const float *sy, const float *sz,
+								 const float *tx_first8, const float *ty_first8, const double *p, float *d_chi2)
+{
+	// access thread id
+	const unsigned int tid = threadIdx.x;
+	const unsigned int tsize = blockDim.x;
+	const unsigned int bid = blockIdx.x;
+
+	int pos = tid + tsize * bid;
+	if (pos < n)
+	{
+		d_chi2[pos] = FnuTrackChi2<Model>(pos, offset, pid, sx, sy, sz, tx_first8, ty_first8, p);
+	}
+}
+
+template <class Model>
+__global__ void calc_chi2_batch_kernel(int n, int nvec, int npar, const int *offset, const int *pid, const float *sx, const float *sy, const float *sz,
+									   const float *tx_first8, const float *ty_first8, const double *p, float *d_chi2)
+{
+	// chi2 of a track for nvec shift vectors. The segments of the track stay in cache between the vectors.
+	int pos = threadIdx.x + blockDim.x * blockIdx.x;
+	if (pos < n)
+	{
+		for (int v = 0; v < nvec; v++)
+		{
+			d_chi2[v * n + pos] = FnuTrackChi2<Model>(pos, offset, pid, sx, sy, sz, tx_first8, ty_first8, p + v * npar);
+		}
+	}
+}
+
+template <class Model>
+__global__ void calc_grad_kernel(int n, const int *offset, const int *pid, const float *sx, const float *sy, const float *sz,
+								 const float *tx_first8, const float *ty_first8, const double *p, const float *d_chi2,
+								 float threshold, double wequal, double *d_gseg)
+{
+	// Derivative of the chi2 of a track used in the trimmed sum for each of its segments.
+
+	// access thread id
+	const unsigned int tid = threadIdx.x;
+	const unsigned int tsize = blockDim.x;
+	const unsigned int bid = blockIdx.x;
+
+	int pos = tid + tsize * bid;
+	if (pos < n)
+	{
+		double weight = d_chi2[pos] < threshold ? 1.0 : d_chi2[pos] == threshold ? wequal : 0.0;
+		if (weight > 0)
+		{
+			FnuTrackGrad<Model>(pos, offset, pid, sx, sy, sz, tx_first8, ty_first8, p, weight, d_gseg);
+			return;
+		}
+		for (int i = offset[pos]; i < offset[pos + 1]; i++)
+		{
+			d_gseg[i * 2] = 0.0;
+			d_gseg[i * 2 + 1] = 0.0;
+		}
+	}
+}
+
+// Kernel launches for one model, called through FnuDispatchModel
+template <class Model>
+struct chi2_launch
+{
+	static void Run(int nblock, int nthread, int n, int nvec, int npar, const int *offset, const int *pid, const float *sx, const float *sy, const float *sz,
+					const float *tx_first8, const float *ty_first8, const double *p, float *d_chi2)
+	{
+		if (nvec == 1)
+			calc_chi2_kernel<Model><<<nblock, nthread>>>(n, offset, pid, sx, sy, sz, tx_first8, ty_first8, p, d_chi2);
+		else
+			calc_chi2_batch_kernel<Model><<<nblock, nthread>>>(n, nvec, npar, offset, pid, sx, sy, sz, tx_first8, ty_first8, p, d_chi2);
+	}
+};
+
+template <class Model>
+struct grad_launch
+{
+	static void Run(int nblock, int nthread, int n, const int *offset, const int *pid, const float *sx, const float *sy, const float *sz,
+					const float *tx_first8, const float *ty_first8, const double *p, const float *d_chi2, float threshold, double wequal, double *d_gseg)
+	{
+		calc_grad_kernel<Model><<<nblock, nthread>>>(n, offset, pid, sx, sy, sz, tx_first8, ty_first8, p, d_chi2, threshold, wequal, d_gseg);
+	}
+};
+
+__global__ void sum_grad_kernel(int npid, const int *pidOffset, const int *pidSeg, const double *d_gseg, double *d_grad)
+{
+	// Sum the derivatives of the segments of each plate in a fixed order
+	int pid = threadIdx.x + blockDim.x * blockIdx.x;
+	if (pid < npid)
+	{
+		double gx = 0, gy = 0;
+		for (int i = pidOffset[pid]; i < pidOffset[pid + 1]; i++)
+		{
+			gx += d_gseg[pidSeg[i] * 2];
+			gy += d_gseg[pidSeg[i] * 2 + 1];
+		}
+		d_grad[pid * 2] = gx;
+		d_grad[pid * 2 + 1] = gy;
+	}
+}
+
+__device__ __host__ inline float hist_edge(float lo, int b, float width)
+{
+	// Lower edge of bin b, rounded the same on host and device
+#ifdef __CUDA_ARCH__
+	return __fadd_rn(lo, __fmul_rn((float)b, width));
+#else
+	return lo + (float)b * width;
+#endif
+}
+
+__device__ __host__ inline int hist_bin(float v, float lo, float width)
+{
+	// Bin of v in [lo, lo + NHISTBIN*width)
+	int b = (v - lo) / width;
+	if (b < 0)
+		b = 0;
+	if (b > NHISTBIN - 1)
+		b = NHISTBIN - 1;
+	while (b > 0 && v < hist_edge(lo, b, width))
+		b--;
+	while (b < NHISTBIN - 1 && v >= hist_edge(lo, b + 1, width))
+		b++;
+	return b;
+}
+
+__global__ void hist_kernel(int n, const float *v, float lo, float hi, float width, int *hist)
+{
+	// Count of the values in [lo, hi] for each bin
+	__shared__ int count[NHISTBIN];
+	for (int b = threadIdx.x; b < NHISTBIN; b += blockDim.x)
+	{
+		count[b] = 0;
+	}
+	__syncthreads();
+	for (int pos = threadIdx.x + blockDim.x * blockIdx.x; pos < n; pos += blockDim.x * gridDim.x)
+	{
+		float x = v[pos];
+		if (x < lo || x > hi)
+			continue;
+		int b = hist_bin(x, lo, width);
+		atomicAdd(&count[b], 1);
+	}
+	__syncthreads();
+	for (int b = threadIdx.x; b < NHISTBIN; b += blockDim.x)
+	{
+		if (count[b] == 0)
+			continue;
+		atomicAdd(&hist[b], count[b]);
+	}
+}
+
+struct in_range
+{
+	float lo, hi;
+	__device__ bool operator()(float x) const { return lo <= x && x <= hi; }
+};
+
+struct value_below
+{
+	float lo;
+	__device__ double operator()(float x) const { return x < lo ? x : 0.0; }
+};
+
+trimmedSum FnuAlignEngineGPU::TrimmedSum(const float *v, int k)
+{
+	// Sum of the k lowest of the ntrk values v on device by histogram refinement of the threshold.
+	// Only the histograms and the last few candidates are copied to host.
+	trimmedSum r;
+	r.sum = 0;
+	r.threshold = 0;
+	r.nbelow = 0;
+	r.nequal = 0;
+	if (k <= 0 || ntrk <= 0)
+		return r;
+	thrust::pair<const float *, const float *> mm = thrust::minmax_element(thrust::device, v, v + ntrk);
+	float lo, hi;
+	checkCudaErrors(cudaMemcpy(&lo, mm.first, sizeof(float), cudaMemcpyDeviceToHost));
+	checkCudaErrors(cudaMemcpy(&hi, mm.second, sizeof(float), cudaMemcpyDeviceToHost));
+
+	int nBelow = 0; // values below lo
+	int nIn = ntrk; // values in [lo, hi]
+	while (nIn > NSELECTHOST)
+	{
+		float width = (hi - lo) / NHISTBIN;
+		if (!(width > 0) || lo + width == lo)
+			break;
+		checkCudaErrors(cudaMemset(d_hist, 0, sizeof(int) * NHISTBIN));
+		hist_kernel<<<64, 256>>>(ntrk, v, lo, hi, width, d_hist);
+		getLastCudaError("hist Kernel execution failed");
+		checkCudaErrors(cudaMemcpy(h_hist, d_hist, sizeof(int) * NHISTBIN, cudaMemcpyDeviceToHost));
+		int b = 0;
+		while (b < NHISTBIN - 1 && nBelow + h_hist[b] < k)
+		{
+			nBelow += h_hist[b];
+			b++;
+		}
+		nIn = h_hist[b];
+		// the upper edge is exclusive except for the last bin
+		if (b < NHISTBIN - 1)
+			hi = nextafterf(hist_edge(lo, b + 1, width), lo);
+		lo = hist_edge(lo, b, width);
+	}
+
+	// Select the rest on host among the values in [lo, hi]
+	float *end = thrust::copy_if(thrust::device, v, v + ntrk, d_select, in_range{lo, hi});
+	int ncand = end - d_select;
+	checkCudaErrors(cudaMemcpy(h_chi2, d_select, sizeof(float) * ncand, cudaMemcpyDeviceToHost));
+	r = FnuTrimmedSumHost(h_chi2, ncand, k - nBelow);
+	// The sum below is taken by a reduction, which is reproducible unlike atomic additions
+	r.sum += thrust::transform_reduce(thrust::device, v, v + ntrk, value_below{lo}, 0.0, thrust::plus<double>());
+	r.nbelow += nBelow;
+	return r;
+}
+
+double FnuAlignEngineGPU::Eval(const double *p, float robustFactor, double *grad)
+{
+	double t0 = FnuWallTime();
+	for (int i = 0; i < nPar; i++)
+	{
+		h_params[i] = p[i];
+	}
+
+	checkCudaErrors(cudaMemcpy(d_params, h_params, sizeof(double) * nPar, cudaMemcpyHostToDevice));
+	double t1 = FnuWallTime();
+	stats.tTransfer += t1 - t0;
+
+	int numthread = 512;
+	int numblock = (ntrk + numthread - 1) / numthread;
+
+	FnuDispatchModel<chi2_launch>(model, numblock, numthread, ntrk, 1, nPar, d_offset, d_pid, d_x, d_y, d_z, d_tx, d_ty, (const double *)d_params, d_chi2);
+	cudaDeviceSynchronize();
+	// check if kernel execution generated and error
+	getLastCudaError("calc chi2 Kernel execution failed");
+	double t2 = FnuWallTime();
+	stats.tKernel += t2 - t1;
+
+	// trimmed sum and its gradient as in FnuTrimmedSum.h, without copying all chi2 to host
+	int nrobust = FnuRobustCount(ntrk, robustFactor);
+	trimmedSum ts = TrimmedSum(d_chi2, nrobust);
+	double delta2 = ts.sum;
+	double t3 = FnuWallTime();
+	stats.tTrimmedSum += t3 - t2;
+	stats.threshold = ts.threshold;
+	stats.nEval++;
+	if (grad == 0)
+		return delta2;
+
+	checkCudaErrors(cudaMemset(d_grad, 0, sizeof(double) * nPar));
+	if (nrobust > 0 && nseg > 0)
+	{
+		FnuDispatchModel<grad_launch>(model, numblock, numthread, ntrk, d_offset, d_pid, d_x, d_y, d_z, d_tx, d_ty, (const double *)d_params, (const float *)d_chi2,
+									  ts.threshold, ts.WeightEqual(nrobust), d_gseg);
+		getLastCudaError("calc grad Kernel execution failed");
+		sum_grad_kernel<<<(nPar / 2 + 127) / 128, 128>>>(nPar / 2, d_pidOffset, d_pidSeg, d_gseg, d_grad);
+		cudaDeviceSynchronize();
+		getLastCudaError("sum grad Kernel execution failed");
+	}
+	double t4 = FnuWallTime();
+	stats.tGrad += t4 - t3;
+	checkCudaErrors(cudaMemcpy(h_grad, d_grad, sizeof(double) * nPar, cudaMemcpyDeviceToHost));
+	for (int i = 0; i < nPar; i++)
+	{
+		grad[i] = h_grad[i];
+	}
+	stats.tTransfer += FnuWallTime() - t4;
+	return delta2;
+}
+
+void FnuAlignEngineGPU::EvalBatch(const double *p, int nvec, float robustFactor, double *fval)
+{
+	// All vectors are copied and evaluated by one kernel, then the trimmed sums are taken one by one
+	if (nvec > batchSize)
+	{
+		checkCudaErrors(cudaFree(d_paramsBatch));
+		checkCudaErrors(cudaFree(d_chi2Batch));
+		checkCudaErrors(cudaMalloc((void **)&d_paramsBatch, sizeof(double) * nPar * nvec));
+		checkCudaErrors(cudaMalloc((void **)&d_chi2Batch, sizeof(float) * ntrk * nvec));
+		batchSize = nvec;
+	}
+	double t0 = FnuWallTime();
+	checkCudaErrors(cudaMemcpy(d_paramsBatch, p, sizeof(double) * nPar * nvec, cudaMemcpyHostToDevice));
+	double t1 = FnuWallTime();
+	stats.tTransfer += t1 - t0;
+
+	int numthread = 128;
+	int numblock = (ntrk + numthread - 1) / numthread;
+	FnuDispatchModel<chi2_launch>(model, numblock, numthread, ntrk, nvec, nPar, d_offset, d_pid, d_x, d_y, d_z, d_tx, d_ty, (const double *)d_paramsBatch, d_chi2Batch);
+	cudaDeviceSynchronize();
+	getLastCudaError("calc chi2 batch Kernel execution failed");
+	double t2 = FnuWallTime();
+	stats.tKernel += t2 - t1;
+
+	int nrobust = FnuRobustCount(ntrk, robustFactor);
+	for (int v = 0; v < nvec; v++)
+	{
+		fval[v] = TrimmedSum(d_chi2Batch + v * ntrk, nrobust).sum;
+	}
+	stats.tTrimmedSum += FnuWallTime() - t2;
+	stats.nEval += nvec;
+}
@@ -0,0 +1,133 @@
+#include "FnuAlignEngine.h"
+#include "FnuTrimmedSum.h"
+
+void FnuAlignEngineHost::SetTile(const alignTile *t, int n)
+{
+	tile = t;
+	nPar = n;
+	ReleaseInliers();
+	chi2.resize(tile->ntrk);
+}
+
+double FnuAlignEngineHost::Eval(const double *p, float robustFactor, double *grad)
+{
+	int ntrk = tile->ntrk;
+
+	double t0 = FnuWallTime();
+	if (Frozen(p))
+		return EvalFrozen(p, grad);
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < ntrk; i++)
+	{
+		chi2[i] = TrackChi2(i, p);
+	}
+	double t1 = FnuWallTime();
+	stats.tKernel += t1 - t0;
+
+	// trimmed sum and its gradient as in FnuTrimmedSum.h
+	work.assign(chi2.begin(), chi2.end());
+	int nrobust = FnuRobustCount(ntrk, robustFactor);
+	trimmedSum ts = FnuTrimmedSumHost(&work[0], ntrk, nrobust);
+	double t2 = FnuWallTime();
+	stats.tTrimmedSum += t2 - t1;
+	stats.threshold = ts.threshold;
+	stats.nEval++;
+	StoreInliers(&chi2[0], ntrk, ts.threshold, ts.WeightEqual(nrobust), p);
+	if (grad == 0)
+		return ts.sum;
+
+	for (int i = 0; i < nPar; i++)
+	{
+		grad[i] = 0;
+	}
+	if (nrobust == 0)
+		return ts.sum;
+	float threshold = ts.threshold;
+	double wequal = ts.WeightEqual(nrobust);
+
+	// Derivatives are stored per segment and summed per plate in segment order,
+	// so that the result does not depend on the number of threads
+	gradSeg.assign(tile->NSeg() * 2, 0.0);
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < ntrk; i++)
+	{
+		if (chi2[i] < threshold)
+			TrackGrad(i, p, 1.0, &gradSeg[0]);
+		else if (chi2[i] == threshold)
+			TrackGrad(i, p, wequal, &gradSeg[0]);
+	}
+	for (int i = 0; i < tile->NSeg(); i++)
+	{
+		grad[tile->pid[i] * 2] += gradSeg[i * 2];
+		grad[tile->pid[i] * 2 + 1] += gradSeg[i * 2 + 1];
+	}
+	stats.tGrad += FnuWallTime() - t2;
+	return ts.sum;
+}
+
+double FnuAlignEngineHost::EvalFrozen(const double *p, double *grad)
+{
+	// Objective and gradient for the tracks kept by StoreInliers
+	int n = inliers.size();
+	double t0 = FnuWallTime();
+#pragma omp parallel for schedule(static)
+	for (int k = 0; k < n; k++)
+	{
+		chi2[inliers[k]] = TrackChi2(inliers[k], p);
+	}
+	double sum = 0;
+	for (int k = 0; k < n; k++)
+	{
+		sum += inlierWeight[inliers[k]] * chi2[inliers[k]];
+	}
+	double t1 = FnuWallTime();
+	stats.tKernel += t1 - t0;
+	stats.nEval++;
+	if (grad == 0)
+		return sum;
+
+	for (int i = 0; i < nPar; i++)
+	{
+		grad[i] = 0;
+	}
+	gradSeg.assign(tile->NSeg() * 2, 0.0);
+#pragma omp parallel for schedule(static)
+	for (int k = 0; k < n; k++)
+	{
+		TrackGrad(inliers[k], p, inlierWeight[inliers[k]], &gradSeg[0]);
+	}
+	for (int i = 0; i < tile->NSeg(); i++)
+	{
+		grad[tile->pid[i] * 2] += gradSeg[i * 2];
+		grad[tile->pid[i] * 2 + 1] += gradSeg[i * 2 + 1];
+	}
+	stats.tGrad += FnuWallTime() - t1;
+	return sum;
+}
+
+void FnuAlignEngineHost::EvalBatch(const double *p, int nvec, float robustFactor, double *fval)
+{
+	// Each track is fitted for all vectors while its segments are in cache
+	int ntrk = tile->ntrk;
+	double t0 = FnuWallTime();
+	chi2Batch.resize((size_t)ntrk * nvec);
+#pragma omp parallel for schedule(static)
+	for (int i = 0; i < ntrk; i++)
+	{
+		for (int v = 0; v < nvec; v++)
+		{
+			chi2Batch[(size_t)v * ntrk + i] = TrackChi2(i, p + (size_t)v * nPar);
+		}
+	}
+
+	double t1 = FnuWallTime();
+	stats.tKernel += t1 - t0;
+	int nrobust = FnuRobustCount(ntrk, robustFactor);
+#pragma omp parallel for schedule(static)
+	for (int v = 0; v < nvec; v++)
+	{
+		fval[v] = FnuTrimmedSumHost(&chi2Batch[(size_t)v * ntrk], ntrk, nrobust).sum;
+	}
+	stats.tTrimmedSum += FnuWallTime() - t1;
+	stats.nEval += nvec;
+}
@@ -0,0 +1,152 @@
+#include "FnuAlignEngine.h"
+
+static const double sigmaPos2 = alignResolution::sigmaPos2;
+static const double sigmaAng2 = alignResolution::sigmaAng2;
+
+FnuAlignEngineQuad::FnuAlignEngineQuad()
+{
+	SetModel(kModelPosAngleDouble);
+}
+
+void FnuAlignEngineQuad::SetModel(int m)
+{
+	// The forms are built in double, so the float models use the same kernels as the double ones
+	model = m;
+	if (FnuAlignModelUsesAngle(model))
+	{
+		formChi2 = &FnuAlignEngineQuad::FormChi2<true>;
+		formGrad = &FnuAlignEngineQuad::FormGrad<true>;
+	}
+	else
+	{
+		formChi2 = &FnuAlignEngineQuad::FormChi2<false>;
+		formGrad = &FnuAlignEngineQuad::FormGrad<false>;
+	}
+}
+
+FnuAlignEngineQuad::~FnuAlignEngineQuad()
+{
+}
+
+void FnuAlignEngineQuad::LoadTile(const alignTile *t, int n)
+{
+	// Fit each track once at zero shifts and keep what the chi2 needs as a function of the shifts.
+	// With z measured from the mean z of the track, the hat matrix of the line fit is
+	// H_ij = 1/n + zc_i*zc_j/A11 and the slope weights are s_i = zc_i/A11.
+	double t0 = FnuWallTime();
+	SetTile(t, n);
+	int ntrk = tile->ntrk;
+	int nseg = tile->NSeg();
+	zc.resize(nseg);
+	rx.resize(nseg);
+	ry.resize(nseg);
+	a.resize(ntrk);
+	invA11.resize(ntrk);
+	ex.resize(ntrk);
+	ey.resize(ntrk);
+	chi2Zero.resize(ntrk);
+#pragma omp parallel for schedule(static)
+	for (int itrk = 0; itrk < ntrk; itrk++)
+	{
+		int begin = tile->offset[itrk];
+		int end = tile->offset[itrk + 1];
+		int n = end - begin;
+		double zmean = 0, xmean = 0, ymean = 0;
+		for (int i = begin; i < end; i++)
+		{
+			zmean += tile->z[i];
+			xmean += tile->x[i];
+			ymean += tile->y[i];
+		}
+		zmean /= n;
+		xmean /= n;
+		ymean /= n;
+		double A11 = 0, A12 = 0, B12 = 0;
+		for (int i = begin; i < end; i++)
+		{
+			double z = tile->z[i] - zmean;
+			A11 += z * z;
+			A12 += z * (tile->x[i] - xmean);
+			B12 += z * (tile->y[i] - ymean);
+		}
+		double tx = A12 / A11;
+		double ty = B12 / A11;
+		double r2 = 0;
+		for (int i = begin; i < end; i++)
+		{
+			zc[i] = tile->z[i] - zmean;
+			rx[i] = tile->x[i] - xmean - tx * zc[i];
+			ry[i] = tile->y[i] - ymean - ty * zc[i];
+			r2 += rx[i] * rx[i] + ry[i] * ry[i];
+		}
+		a[itrk] = 1.0 / (sigmaPos2 * n);
+		invA11[itrk] = 1.0 / A11;
+		ex[itrk] = tile->tx_first8[itrk] - tx;
+		ey[itrk] = tile->ty_first8[itrk] - ty;
+		chi2Zero[itrk] = a[itrk] * r2;
+	}
+	stats.tLoad += FnuWallTime() - t0;
+}
+
+template <bool UseAngle>
+float FnuAlignEngineQuad::FormChi2(int itrk, const double *p)
+{
+	// a*(|r|^2 + 2r.u + |u|^2 - u.Hu) + c*(e - s.u)^2 for x and y, using r.1 = r.zc = 0
+	const int *pid = &tile->pid[0];
+	int begin = tile->offset[itrk];
+	int end = tile->offset[itrk + 1];
+	double S0x = 0, S1x = 0, Suux = 0, Srux = 0;
+	double S0y = 0, S1y = 0, Suuy = 0, Sruy = 0;
+#pragma omp simd reduction(+ : S0x, S1x, Suux, Srux, S0y, S1y, Suuy, Sruy)
+	for (int i = begin; i < end; i++)
+	{
+		double ux = p[pid[i] * 2];
+		double uy = p[pid[i] * 2 + 1];
+		S0x += ux;
+		S1x += zc[i] * ux;
+		Suux += ux * ux;
+		Srux += rx[i] * ux;
+		S0y += uy;
+		S1y += zc[i] * uy;
+		Suuy += uy * uy;
+		Sruy += ry[i] * uy;
+	}
+	int n = end - begin;
+	double k = invA11[itrk];
+	double pos = 2 * (Srux + Sruy) + Suux + Suuy - (S0x * S0x + S0y * S0y) / n - (S1x * S1x + S1y * S1y) * k;
+	if (!UseAngle)
+		return chi2Zero[itrk] + a[itrk] * pos;
+	double dtx = ex[itrk] - S1x * k;
+	double dty = ey[itrk] - S1y * k;
+	return chi2Zero[itrk] + a[itrk] * pos + (dtx * dtx + dty * dty) / sigmaAng2;
+}
+
+template <bool UseAngle>
+void FnuAlignEngineQuad::FormGrad(int itrk, const double *p, double w, double *gseg)
+{
+	// Derivative of w times the track chi2 with respect to the shifts of its segments
+	const int *pid = &tile->pid[0];
+	int begin = tile->offset[itrk];
+	int end = tile->offset[itrk + 1];
+	int n = end - begin;
+	double S0x = 0, S1x = 0, S0y = 0, S1y = 0;
+	for (int i = begin; i < end; i++)
+	{
+		S0x += p[pid[i] * 2];
+		S1x += zc[i] * p[pid[i] * 2];
+		S0y += p[pid[i] * 2 + 1];
+		S1y += zc[i] * p[pid[i] * 2 + 1];
+	}
+	double k = invA11[itrk];
+	double cPos = w * 2 * a[itrk];
+	double cAngX = UseAngle ? -w * 2 * (ex[itrk] - S1x * k) * k / sigmaAng2 : 0;
+	double cAngY = UseAngle ? -w * 2 * (ey[itrk] - S1y * k) * k / sigmaAng2 : 0;
+	for (int i = begin; i < end; i++)
+	{
+		// (1-H)u + r is the residual at u
+		double dx = rx[i] + p[pid[i] * 2] - S0x / n - zc[i] * S1x * k;
+		double dy = ry[i] + p[pid[i] * 2 + 1] - S0y / n - zc[i] * S1y * k;
+		gseg[i * 2] = cPos * dx + cAngX * zc[i];
+		gseg[i * 2 + 1] = cPos * dy + cAngY * zc[i];
+	}
+}
@@ -0,0 +1,284 @@
+#include "FnuAlignGN.h"
+#include "FnuTrimmedSum.h"
+
+#include <stdio.h>
+#include <math.h>
+
+static const double sigmaPos2 = alignResolution::sigmaPos2;
+static const double sigmaAng2 = alignResolution::sigmaAng2;
+
+FnuAlignGN::FnuAlignGN()
+	: maxIterations(20), nIterations(0), fval(0), useAngle(true), bandWidth(0)
+{
+}
+
+double FnuAlignGN::TrackChi2(const alignTile *tile, int itrk, const double *p)
+{
+	// Same model as calc_chi2_kernel, in double
+	int begin = tile->offset[itrk];
+	int end = tile->offset[itrk + 1];
+	double A00 = end - begin, A01 = 0, A02 = 0, A11 = 0, A12 = 0;
+	double B02 = 0, B12 = 0;
+	for (int i = begin; i < end; i++)
+	{
+		double x = tile->x[i] + p[tile->pid[i] * 2];
+		double y = tile->y[i] + p[tile->pid[i] * 2 + 1];
+		double z = tile->z[i];
+		A01 += z;
+		A02 += x;
+		A11 += z * z;
+		A12 += z * x;
+		B02 += y;
+		B12 += z * y;
+	}
+	double det = A00 * A11 - A01 * A01;
+	double x0 = (A02 * A11 - A01 * A12) / det;
+	double tx = (A00 * A12 - A01 * A02) / det;
+	double y0 = (B02 * A11 - A01 * B12) / det;
+	double ty = (A00 * B12 - A01 * B02) / det;
+	double chi2 = 0;
+	for (int i = begin; i < end; i++)
+	{
+		double z = tile->z[i];
+		double dx = tile->x[i] + p[tile->pid[i] * 2] - (x0 + tx * z);
+		double dy = tile->y[i] + p[tile->pid[i] * 2 + 1] - (y0 + ty * z);
+		chi2 += dx * dx + dy * dy;
+	}
+	chi2 /= sigmaPos2 * (end - begin);
+	if (!useAngle)
+		return chi2;
+	double dtx = tile->tx_first8[itrk] - tx;
+	double dty = tile->ty_first8[itrk] - ty;
+	chi2 += (dtx * dtx + dty * dty) / sigmaAng2;
+	return chi2;
+}
+
+void FnuAlignGN::AddTrack(const alignTile *tile, int itrk, double w)
+{
+	// Add the normal equations of one track.
+	// With the hat matrix H of the line fit and the slope weights s_i = (A00*z_i - A01)/det,
+	// the track chi2 is a*|(1-H)(x+p)|^2 + c*(tx0 - s.(x+p))^2.
+	int begin = tile->offset[itrk];
+	int end = tile->offset[itrk + 1];
+	int n = end - begin;
+	const float *z = &tile->z[begin];
+	const float *sx = &tile->x[begin];
+	const float *sy = &tile->y[begin];
+	const int *pid = &tile->pid[begin];
+
+	double A00 = n, A01 = 0, A11 = 0, A02 = 0, A12 = 0, B02 = 0, B12 = 0;
+	for (int i = 0; i < n; i++)
+	{
+		A01 += z[i];
+		A11 += (double)z[i] * z[i];
+		A02 += sx[i];
+		A12 += (double)z[i] * sx[i];
+		B02 += sy[i];
+		B12 += (double)z[i] * sy[i];
+	}
+	double det = A00 * A11 - A01 * A01;
+	double x0 = (A02 * A11 - A01 * A12) / det;
+	double tx = (A00 * A12 - A01 * A02) / det;
+	double y0 = (B02 * A11 - A01 * B12) / det;
+	double ty = (A00 * B12 - A01 * B02) / det;
+	double a = w / (sigmaPos2 * n);
+	double c = useAngle ? w / sigmaAng2 : 0;
+	double ex = tile->tx_first8[itrk] - tx;
+	double ey = tile->ty_first8[itrk] - ty;
+
+	int nb = bandWidth + 1;
+	for (int i = 0; i < n; i++)
+	{
+		double si = (A00 * z[i] - A01) / det;
+		int qi = pid[i];
+		// right hand side is minus the gradient at p = 0, divided by 2
+		double rx = sx[i] - (x0 + tx * z[i]);
+		double ry = sy[i] - (y0 + ty * z[i]);
+		rhsX[qi] -= a * rx - c * si * ex;
+		rhsY[qi] -= a * ry - c * si * ey;
+		for (int j = 0; j < n; j++)
+		{
+			int qj = pid[j];
+			if (qi < qj)
+				continue;
+			double sj = (A00 * z[j] - A01) / det;
+			double hij = (A11 - A01 * (z[i] + z[j]) + A00 * (double)z[i] * z[j]) / det;
+			double mij = a * ((i == j) - hij) + c * si * sj;
+			band[qi * nb + (qi - qj)] += mij;
+		}
+	}
+}
+
+int FnuAlignGN::Cholesky(int n)
+{
+	// In-place Cholesky factorization of the band matrix. Returns 1 if it is not positive definite.
+	int b = bandWidth;
+	int nb = b + 1;
+	for (int j = 0; j < n; j++)
+	{
+		double s = band[j * nb];
+		for (int k = j - b > 0 ? j - b : 0; k < j; k++)
+			s -= band[j * nb + (j - k)] * band[j * nb + (j - k)];
+		if (s <= 0)
+			return 1;
+		double ljj = sqrt(s);
+		band[j * nb] = ljj;
+		for (int i = j + 1; i <= j + b && i < n; i++)
+		{
+			double t = band[i * nb + (i - j)];
+			for (int k = i - b > 0 ? i - b : 0; k < j; k++)
+				t -= band[i * nb + (i - k)] * band[j * nb + (j - k)];
+			band[i * nb + (i - j)] = t / ljj;
+		}
+	}
+	return 0;
+}
+
+void FnuAlignGN::SolveCholesky(int n, std::vector<double> &v)
+{
+	// Solve L L^T x = v in place
+	int b = bandWidth;
+	int nb = b + 1;
+	for (int i = 0; i < n; i++)
+	{
+		double t = v[i];
+		for (int k = i - b > 0 ? i - b : 0; k < i; k++)
+			t -= band[i * nb + (i - k)] * v[k];
+		v[i] = t / band[i * nb];
+	}
+	for (int i = n - 1; i >= 0; i--)
+	{
+		double t = v[i];
+		for (int k = i + 1; k <= i + b && k < n; k++)
+			t -= band[k * nb + (k - i)] * v[k];
+		v[i] = t / band[i * nb];
+	}
+}
+
+int FnuAlignGN::Solve(const alignTile *tile, int nPID, const std::vector<int> &fixed, float robustFactor, const double *low, const double *high, double *p)
+{
+	int ntrk = tile->ntrk;
+	int nrobust = FnuRobustCount(ntrk, robustFactor);
+	std::vector<double> prevWeight;
+	chi2.resize(ntrk);
+
+	int converged = 0;
+	for (nIterations = 0; nIterations <= maxIterations; nIterations++)
+	{
+		// Select the tracks used at the current shifts
+#pragma omp parallel for schedule(static)
+		for (int itrk = 0; itrk < ntrk; itrk++)
+		{
+			chi2[itrk] = TrackChi2(tile, itrk, p);
+		}
+		work.assign(chi2.begin(), chi2.end());
+		trimmedSum ts = FnuTrimmedSumHost(&work[0], ntrk, nrobust);
+		fval = ts.sum;
+		weight.assign(ntrk, 0.0);
+		for (int itrk = 0; itrk < ntrk; itrk++)
+		{
+			float c = chi2[itrk];
+			if (c < ts.threshold)
+				weight[itrk] = 1.0;
+			else if (c == ts.threshold)
+				weight[itrk] = ts.WeightEqual(nrobust);
+		}
+		if (weight == prevWeight)
+		{
+			converged = 1;
+			break;
+		}
+		if (nIterations == maxIterations)
+			break;
+
+		// Normal equations for the selected tracks
+		bandWidth = 0;
+		for (int itrk = 0; itrk < ntrk; itrk++)
+		{
+			if (weight[itrk] == 0 || tile->offset[itrk + 1] == tile->offset[itrk])
+				continue;
+			int pmin = nPID, pmax = 0;
+			for (int i = tile->offset[itrk]; i < tile->offset[itrk + 1]; i++)
+			{
+				if (tile->pid[i] < pmin)
+					pmin = tile->pid[i];
+				if (tile->pid[i] > pmax)
+					pmax = tile->pid[i];
+			}
+			if (pmax - pmin > bandWidth)
+				bandWidth = pmax - pmin;
+		}
+		int nb = bandWidth + 1;
+		band.assign(nPID * nb, 0.0);
+		rhsX.assign(nPID, 0.0);
+		rhsY.assign(nPID, 0.0);
+		for (int itrk = 0; itrk < ntrk; itrk++)
+		{
+			if (weight[itrk] > 0)
+				AddTrack(tile, itrk, weight[itrk]);
+		}
+
+		// Fixed plates and plates without segments keep their p.
+		// Their couplings move to the right hand side of the other plates.
+		// A small ridge keeps directions which the tracks do not constrain at 0.
+		double maxDiag = 0;
+		for (int i = 0; i < nPID; i++)
+		{
+			if (band[i * nb] > maxDiag)
+				maxDiag = band[i * nb];
+		}
+		keep.assign(nPID, 0);
+		for (int i = 0; i < nPID; i++)
+		{
+			keep[i] = fixed[i] != 0 || band[i * nb] <= 0;
+			if (!keep[i])
+				continue;
+			for (int d = 1; d < nb; d++)
+			{
+				if (i - d >= 0)
+				{
+					rhsX[i - d] -= band[i * nb + d] * p[i * 2];
+					rhsY[i - d] -= band[i * nb + d] * p[i * 2 + 1];
+				}
+				if (i + d < nPID)
+				{
+					rhsX[i + d] -= band[(i + d) * nb + d] * p[i * 2];
+					rhsY[i + d] -= band[(i + d) * nb + d] * p[i * 2 + 1];
+				}
+			}
+		}
+		for (int i = 0; i < nPID; i++)
+		{
+			if (!keep[i])
+			{
+				band[i * nb] += 1e-10 * maxDiag;
+				continue;
+			}
+			for (int d = 0; d < nb; d++)
+			{
+				band[i * nb + d] = 0;
+				if (i + d < nPID)
+					band[(i + d) * nb + d] = 0;
+			}
+			band[i * nb] = 1;
+			rhsX[i] = p[i * 2];
+			rhsY[i] = p[i * 2 + 1];
+		}
+		if (Cholesky(nPID) != 0)
+		{
+			printf("FnuAlignGN: normal matrix is not positive definite\n");
+			break;
+		}
+		SolveCholesky(nPID, rhsX);
+		SolveCholesky(nPID, rhsY);
+		for (int i = 0; i < nPID; i++)
+		{
+			if (keep[i])
+				continue;
+			p[i * 2] = fmax(low[i * 2], fmin(high[i * 2], rhsX[i]));
+			p[i * 2 + 1] = fmax(low[i * 2 + 1], fmin(high[i * 2 + 1], rhsY[i]));
+		}
+		prevWeight.swap(weight);
+	}
+	return converged ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+#include "FnuAlignMap.h"
+
+#include <stdio.h>
+#include <math.h>
+
+#include <TFile.h>
+#include <TTree.h>
+
+FnuAlignMap::FnuAlignMap()
+	: nX(0), nY(0), nPID(0), Xmin(0), Ymin(0), binWidth(1)
+{
+}
+
+void FnuAlignMap::Init(int nx, int ny, double xmin, double ymin, double bwidth, int npid)
+{
+	nX = nx;
+	nY = ny;
+	Xmin = xmin;
+	Ymin = ymin;
+	binWidth = bwidth;
+	nPID = npid;
+	fitted.assign(nX * nY, 0);
+	level.assign(nX * nY, 0);
+	shift.assign(nX * nY * nPID * 2, 0.0);
+}
+
+int FnuAlignMap::FindTile(double x, double y) const
+{
+	// Same rule as FnuTileIndex::FindTile, segments on a border belong to no tile
+	int ix = (int)floor((x - Xmin) / binWidth);
+	int iy = (int)floor((y - Ymin) / binWidth);
+	if (ix < 0 || ix >= nX || iy < 0 || iy >= nY)
+		return -1;
+	if (fabs(x - CenterX(ix)) >= binWidth / 2 || fabs(y - CenterY(iy)) >= binWidth / 2)
+		return -1;
+	return ix + iy * nX;
+}
+
+void FnuAlignMap::SetShift(int itile, const double *p, int lev)
+{
+	for (int i = 0; i < nPID * 2; i++)
+	{
+		shift[itile * nPID * 2 + i] = p[i];
+	}
+	fitted[itile] = 1;
+	level[itile] = lev;
+}
+
+void FnuAlignMap::Shift(double x, double y, int pid, bool interpolate, double &dx, double &dy) const
+{
+	dx = dy = 0;
+	if (pid < 0 || pid >= nPID)
+		return;
+	if (!interpolate)
+	{
+		int itile = FindTile(x, y);
+		if (itile >= 0 && fitted[itile])
+		{
+			dx = shift[(itile * nPID + pid) * 2];
+			dy = shift[(itile * nPID + pid) * 2 + 1];
+		}
+		return;
+	}
+
+	// Four tile centers around (x, y), clamped to the grid for the half tile at its border.
+	// Tiles which were not fitted are left out and the weights of the others are normalized.
+	if (FindTile(x, y) < 0)
+		return;
+	double fx = (x - Xmin) / binWidth - 0.5;
+	double fy = (y - Ymin) / binWidth - 0.5;
+	fx = fmax(0.0, fmin(fx, nX - 1.0));
+	fy = fmax(0.0, fmin(fy, nY - 1.0));
+	int ix0 = (int)fx < nX - 1 ? (int)fx : nX - 1;
+	int iy0 = (int)fy < nY - 1 ? (int)fy : nY - 1;
+	double ux = fx - ix0, uy = fy - iy0;
+	double wsum = 0;
+	for (int j = 0; j < 2; j++)
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			int ix = ix0 + i, iy = iy0 + j;
+			if (ix >= nX || iy >= nY)
+				continue;
+			int itile = ix + iy * nX;
+			double w = (i ? ux : 1 - ux) * (j ? uy : 1 - uy);
+			if (!fitted[itile] || w == 0)
+				continue;
+			dx += w * shift[(itile * nPID + pid) * 2];
+			dy += w * shift[(itile * nPID + pid) * 2 + 1];
+			wsum += w;
+		}
+	}
+	if (wsum > 0)
+	{
+		dx /= wsum;
+		dy /= wsum;
+	}
+}
+
+void FnuAlignMap::ApplySegment(EdbSegP *s, bool interpolate) const
+{
+	double dx, dy;
+	Shift(s->X(), s->Y(), s->PID(), interpolate, dx, dy);
+	s->SetX(s->X() + dx);
+	s->SetY(s->Y() + dy);
+}
+
+void FnuAlignMap::Apply(TObjArray *tracks, bool interpolate) const
+{
+	// Each segment is looked up once, tracks are independent
+	int ntrk = tracks->GetEntriesFast();
+#pragma omp parallel for schedule(dynamic, 64)
+	for (int itrk = 0; itrk < ntrk; itrk++)
+	{
+		EdbTrackP *t = (EdbTrackP *)tracks->At(itrk);
+		for (int iseg = 0; iseg < t->N(); iseg++)
+		{
+			ApplySegment(t->GetSegment(iseg), interpolate);
+		}
+	}
+}
+
+void FnuAlignMap::Write(TString filename) const
+{
+	// One entry with the grid and the shifts of all tiles
+	int nx = nX, ny = nY, npid = nPID;
+	double xmin = Xmin, ymin = Ymin, bwidth = binWidth;
+	std::vector<int> f = fitted;
+	std::vector<int> l = level;
+	std::vector<double> s = shift;
+	TFile fout(filename, "recreate");
+	TTree tree("alignMap", "alignMap");
+	tree.Branch("nX", &nx);
+	tree.Branch("nY", &ny);
+	tree.Branch("nPID", &npid);
+	tree.Branch("Xmin", &xmin);
+	tree.Branch("Ymin", &ymin);
+	tree.Branch("binWidth", &bwidth);
+	tree.Branch("fitted", &f);
+	tree.Branch("level", &l);
+	tree.Branch("shift", &s);
+	tree.Fill();
+	tree.Write();
+	fout.Close();
+}
+
+int FnuAlignMap::Read(TString filename)
+{
+	// Read a map written by Write. Returns 1 on failure.
+	TFile fin(filename);
+	if (fin.IsZombie())
+	{
+		printf("Cannot open %s\n", filename.Data());
+		return 1;
+	}
+	TTree *tree = (TTree *)fin.Get("alignMap");
+	if (tree == 0 || tree->GetEntries() < 1)
+	{
+		printf("No alignMap in %s\n", filename.Data());
+		return 1;
+	}
+	std::vector<int> *f = 0;
+	std::vector<int> *l = 0;
+	std::vector<double> *s = 0;
+	tree->SetBranchAddress("nX", &nX);
+	tree->SetBranchAddress("nY", &nY);
+	tree->SetBranchAddress("nPID", &nPID);
+	tree->SetBranchAddress("Xmin", &Xmin);
+	tree->SetBranchAddress("Ymin", &Ymin);
+	tree->SetBranchAddress("binWidth", &binWidth);
+	tree->SetBranchAddress("fitted", &f);
+	tree->SetBranchAddress("shift", &s);
+	// maps without adaptive tiling have no level
+	if (tree->GetBranch("level") != 0)
+		tree->SetBranchAddress("level", &l);
+	tree->GetEntry(0);
+	fitted = *f;
+	shift = *s;
+	if (l != 0)
+		level = *l;
+	else
+		level.assign(nX * nY, 0);
+	fin.Close();
+	delete f;
+	delete l;
+	delete s;
+	printf("Alignment map %s: %d x %d tiles of %.0f um, %d plates\n", filename.Data(), nX, nY, binWidth, nPID);
+	return 0;
+}
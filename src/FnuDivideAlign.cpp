@@ -0,0 +1,1025 @@
+#include "FnuDivideAlign.h"
+
+#include <stdio.h>
+#include <assert.h>
+#include <algorithm>
+#include <EdbPattern.h>
+#include <TFile.h>
+#include <TROOT.h>
+
+#include <omp.h>
+
+FnuAlignEngine *FnuCreateAlignEngine(int type)
+{
+	if (type == kAlignEngineCPU)
+		return new FnuAlignEngineCPU;
+	if (type == kAlignEngineQuad)
+		return new FnuAlignEngineQuad;
+#ifndef FNU_NO_CUDA
+	if (type == kAlignEngineGPU)
+		return new FnuAlignEngineGPU;
+#endif
+	return 0;
+}
+
+FnuAlignWorker::FnuAlignWorker(int engineType, int minimizerType, int nPar)
+	: engine(FnuCreateAlignEngine(engineType)), minimizer(FnuCreateMinimizer(minimizerType, nPar)), robustFactor(1.0), nParams(nPar), ncall(0), nGradCall(0), nIter(0), tMinimize(0), status(0), fval(0), batchGradient(false),
+	  params(nPar, 0.0), grad(nPar, 0.0)
+{
+}
+
+FnuAlignWorker::~FnuAlignWorker()
+{
+	delete engine;
+	delete minimizer;
+}
+
+double FnuAlignWorker::Eval(const double *p, double *g)
+{
+	// Objective for the current tile. g is filled if it is given.
+	// p and g have nParams elements, which the engine reads and writes directly.
+	double delta2;
+	if (g != 0 && batchGradient)
+	{
+		params.assign(p, p + nParams);
+		delta2 = EvalStencil(g);
+	}
+	else
+	{
+		delta2 = engine->Eval(p, robustFactor, g);
+	}
+
+	// regularization
+	//  double lambda = 0.1;
+	//  for(int i=0;i<nPID*2)
+	//  {
+	//  	delta2+=lambda*p[i]*p[i]; //L2 regularization
+	//  	// delta2+=lambda*abs(p[i]); //L1 regularization
+	//  }
+
+	if (ncall % 1000 == 0)
+	{
+		printf("ncall=%d fval = %lf ", ncall, delta2);
+		for (int i = 0; i < 10 && i < nParams; i++)
+		{
+			printf("%4.1lf ", p[i]);
+		}
+		printf("\n");
+	}
+	ncall++;
+	return delta2;
+}
+
+double FnuAlignWorker::EvalStencil(double *g)
+{
+	// Objective at params and the central differences of the free parameters,
+	// evaluated as batches of vectors so that the engine reads the tile once per batch
+	const double h = 0.1;	 // um, larger than the float precision of the positions
+	const int nBatch = 64; // vectors per EvalBatch call
+	int nvec = 1 + 2 * freePar.size();
+	batchParams.resize((size_t)nBatch * nParams);
+	batchFval.resize(nvec);
+	for (int v0 = 0; v0 < nvec; v0 += nBatch)
+	{
+		int n = nvec - v0 < nBatch ? nvec - v0 : nBatch;
+		for (int j = 0; j < n; j++)
+		{
+			double *q = &batchParams[(size_t)j * nParams];
+			for (int i = 0; i < nParams; i++)
+			{
+				q[i] = params[i];
+			}
+			// vector 0 is params, then +h and -h for each free parameter
+			int v = v0 + j;
+			if (v > 0)
+				q[freePar[(v - 1) / 2]] += (v % 2 == 1) ? h : -h;
+		}
+		engine->EvalBatch(&batchParams[0], n, robustFactor, &batchFval[v0]);
+	}
+	for (int i = 0; i < nParams; i++)
+	{
+		g[i] = 0;
+	}
+	for (int j = 0; j < freePar.size(); j++)
+	{
+		g[freePar[j]] = (batchFval[1 + 2 * j] - batchFval[2 + 2 * j]) / (2 * h);
+	}
+	return batchFval[0];
+}
+
+FnuDivideAlign::FnuDivideAlign()
+	: binWidth(2000), alignPar(0), alignStat(0), nPID(0), rangeXY(8500), robustFactor(1.0), gradientMode(kGradientNumerical), solver(kSolverMigrad), nThreads(1), pyramidLevels(1), pyramidWindow(10), interpolate(false), plateWindow(0), plateOverlap(0), maxSweeps(10), sweepTolerance(0.01), freezeCalls(0), freezeStep(0), adaptiveTracks(0), residualModel(kModelPosAngleDouble)
+{
+#ifdef FNU_NO_CUDA
+	engineType = kAlignEngineCPU;
+#else
+	engineType = kAlignEngineGPU;
+#endif
+}
+
+FnuDivideAlign::~FnuDivideAlign()
+{
+	DeleteWorkers();
+	delete alignPar;
+	delete alignStat;
+}
+
+void FnuDivideAlign::SetBinWidth(double bwidth)
+{
+	binWidth = bwidth;
+}
+
+void FnuDivideAlign::SetRobustFactor(float rfactor)
+{
+	robustFactor = rfactor;
+}
+
+double FnuDivideAlign::GetBinWidth()
+{
+	return binWidth;
+}
+
+float FnuDivideAlign::GetRobustFactor()
+{
+	return robustFactor;
+}
+
+int FnuDivideAlign::SetEngine(int type)
+{
+	// Select the engine to evaluate the objective (kAlignEngineGPU, kAlignEngineCPU or kAlignEngineQuad)
+	bool available = type == kAlignEngineCPU || type == kAlignEngineQuad;
+#ifndef FNU_NO_CUDA
+	available = available || type == kAlignEngineGPU;
+#endif
+	if (!available)
+	{
+		printf("Alignment engine %d is not available in this build\n", type);
+		return 1;
+	}
+	engineType = type;
+	DeleteWorkers();
+	return 0;
+}
+
+int FnuDivideAlign::GetEngine()
+{
+	return engineType;
+}
+
+int FnuDivideAlign::SetGradientMode(int mode)
+{
+	// kGradientNumerical : the minimizer calculates derivatives by finite differences, L-BFGS gets the central differences of kGradientBatch
+	// kGradientAnalytic : the minimizer gets the exact gradient
+	// kGradientCheck : same as kGradientAnalytic, but compare with numerical derivatives before each fit
+	// kGradientBatch : the minimizer gets central differences evaluated in one batch per call
+	if (freezeCalls > 0 && UsesStencil(mode, solver))
+	{
+		printf("freeze= needs the analytic gradient (grad or gradcheck), the batches of numerical derivatives always rank the tracks\n");
+		return 1;
+	}
+	gradientMode = mode;
+	return 0;
+}
+
+int FnuDivideAlign::GetGradientMode()
+{
+	return gradientMode;
+}
+
+int FnuDivideAlign::SetSolver(int s)
+{
+	// kSolverMigrad : minimize the trimmed chi2 with Minuit
+	// kSolverGaussNewton : solve the normal equations and re-select the used tracks until they converge
+	// kSolverMinuit2 : minimize the trimmed chi2 with Minuit2
+	// kSolverLBFGS : minimize the trimmed chi2 with L-BFGS within the bounds of the shifts
+	if (freezeCalls > 0 && UsesStencil(gradientMode, s))
+	{
+		printf("freeze= needs the analytic gradient (grad or gradcheck), the batches of numerical derivatives always rank the tracks\n");
+		return 1;
+	}
+	if (s != kSolverGaussNewton)
+	{
+		FnuMinimizer *m = FnuCreateMinimizer(MinimizerType(s), 1);
+		if (m == 0)
+		{
+			printf("Solver %d is not available in this build\n", s);
+			return 1;
+		}
+		delete m;
+	}
+	solver = s;
+	DeleteWorkers();
+	return 0;
+}
+
+int FnuDivideAlign::GetSolver()
+{
+	return solver;
+}
+
+bool FnuDivideAlign::UsesStencil(int mode, int s)
+{
+	// True if the minimizer gets its derivatives from EvalStencil
+	return mode == kGradientBatch || (mode == kGradientNumerical && MinimizerType(s) == kMinimizerLBFGS);
+}
+
+int FnuDivideAlign::MinimizerType(int s)
+{
+	// Minimizer of the workers for a solver. Gauss-Newton does not use it.
+	if (s == kSolverMinuit2)
+		return kMinimizerMinuit2;
+	if (s == kSolverLBFGS)
+		return kMinimizerLBFGS;
+	return kMinimizerMinuit;
+}
+
+const char *FnuDivideAlign::SolverName(int s)
+{
+	switch (s)
+	{
+	case kSolverMigrad:
+		return "Migrad";
+	case kSolverGaussNewton:
+		return "Gauss-Newton";
+	case kSolverMinuit2:
+		return "Minuit2";
+	case kSolverLBFGS:
+		return "L-BFGS";
+	}
+	return "unknown";
+}
+
+void FnuDivideAlign::SetNThreads(int n)
+{
+	// Number of tiles fitted at once. Each thread has its own engine and minimizer.
+	// With n == 1 the CPU engine uses all cores inside each tile instead.
+	nThreads = n > 0 ? n : omp_get_max_threads();
+	DeleteWorkers();
+}
+
+int FnuDivideAlign::GetNThreads()
+{
+	return nThreads;
+}
+
+void FnuDivideAlign::SetPyramid(int levels, double window)
+{
+	// Number of levels of the multi-resolution alignment, 1 for a single binWidth.
+	// Below the coarsest level, shifts are searched within window um of the parent shifts.
+	pyramidLevels = levels > 0 ? levels : 1;
+	pyramidWindow = window;
+}
+
+int FnuDivideAlign::GetPyramidLevels()
+{
+	return pyramidLevels;
+}
+
+void FnuDivideAlign::SetPlateWindows(int size, int overlap, int sweeps)
+{
+	// Fit windows of size consecutive plates which overlap by overlap plates instead of all plates at once.
+	// size == 0 fits all plates together. A track needs 3 segments in a window, so windows have at least 3 plates.
+	if (size > 0 && size < 3)
+	{
+		printf("Plate windows need at least 3 plates, all plates are fitted together\n");
+		size = 0;
+	}
+	if (size > 0 && (overlap < 1 || overlap >= size))
+	{
+		printf("Plate windows need 1 <= overlap < size, overlap set to %d\n", size / 2 > 1 ? size / 2 : 1);
+		overlap = size / 2 > 1 ? size / 2 : 1;
+	}
+	plateWindow = size;
+	plateOverlap = overlap;
+	maxSweeps = sweeps;
+}
+
+int FnuDivideAlign::SetInlierFreeze(int ncalls, double maxStep)
+{
+	// Keep the tracks used by the trimmed sum for up to ncalls evaluations of Minuit while
+	// the shifts stay within maxStep um of where the tracks were ranked. ncalls = 0 ranks at every call.
+	// The CPU and Quad engines support it, the GPU engine always ranks.
+	// EvalBatch always ranks, so the freeze is rejected when the derivatives come from EvalStencil,
+	// which would mix values of the frozen set with differences of freshly ranked sets.
+	if (ncalls > 0 && UsesStencil(gradientMode, solver))
+	{
+		printf("freeze= needs the analytic gradient (grad or gradcheck), the batches of numerical derivatives always rank the tracks\n");
+		return 1;
+	}
+	freezeCalls = ncalls;
+	freezeStep = maxStep;
+	return 0;
+}
+
+void FnuDivideAlign::SetAdaptive(int ntrk)
+{
+	// Refine the tiles of the pyramid only where they have at least ntrk track candidates.
+	// Other tiles keep the shifts of their parent tile, so sparse areas are aligned with larger tiles.
+	// ntrk = 0 fits every tile of each level with 20 candidates.
+	adaptiveTracks = ntrk;
+}
+
+void FnuDivideAlign::SetModel(int model)
+{
+	// Residual model of the track chi2 (FnuAlignModelType): position and angle terms or position only,
+	// summed in double or in float
+	residualModel = model;
+	printf("Residual model: %s\n", FnuAlignModelName(model));
+}
+
+int FnuDivideAlign::GetModel()
+{
+	return residualModel;
+}
+
+void FnuDivideAlign::SetInterpolation(bool flag)
+{
+	// Apply the shifts interpolated between tile centers instead of constant shifts per tile
+	interpolate = flag;
+}
+
+int FnuDivideAlign::SetCacheDirectory(const char *dir)
+{
+	// Tile results are stored in dir and reused by later runs with the same tiles and settings
+	return cache.SetDirectory(dir);
+}
+
+void FnuDivideAlign::CreateWorkers()
+{
+	// Minimizer instances are created here, before the threads start
+	if ((int)workers.size() == nThreads && workers[0]->nParams == nPID * 2)
+		return;
+	DeleteWorkers();
+	for (int i = 0; i < nThreads; i++)
+	{
+		workers.push_back(new FnuAlignWorker(engineType, MinimizerType(solver), nPID * 2));
+	}
+	// once per run instead of once per engine
+	printf("%s alignment engine, %d workers with %d threads\n", workers[0]->engine->GetName(), nThreads, omp_get_max_threads());
+}
+
+void FnuDivideAlign::DeleteWorkers()
+{
+	for (int i = 0; i < workers.size(); i++)
+	{
+		delete workers[i];
+	}
+	workers.clear();
+}
+
+void FnuDivideAlign::CalcAlignPar(TObjArray *tracks, double iX, double iY, int fixflag)
+{
+	// Calculate alignment parameters in a divided area
+	int ntrk = tracks->GetEntriesFast();
+	if (nPID == 0)
+	{
+		// plates of the tracks when Align has not been called
+		for (int i = 0; i < ntrk; i++)
+		{
+			EdbTrackP *t = (EdbTrackP *)tracks->At(i);
+			for (int iseg = 0; iseg < t->N(); iseg++)
+			{
+				if (t->GetSegment(iseg)->PID() >= nPID)
+					nPID = t->GetSegment(iseg)->PID() + 1;
+			}
+		}
+	}
+	p.assign(nPID * 2, 0.0);
+	CreateWorkers();
+	alignTile &tile = workers[0]->tile;
+
+	// Setup structures for tracks. Only segments in the area are stored.
+	tile.Clear();
+	for (int i = 0; i < ntrk; i++)
+	{
+		EdbTrackP *t = (EdbTrackP *)tracks->At(i);
+		for (int iseg = 0; iseg < t->N(); iseg++)
+		{
+			EdbSegP *s = t->GetSegment(iseg);
+			if (fabs(s->X() - iX) < binWidth / 2 && fabs(s->Y() - iY) < binWidth / 2)
+			{
+				tile.AddSegment(s->PID(), s->X(), s->Y(), s->Z());
+			}
+		}
+		tile.AddTrack(t->TX(), t->TY());
+	}
+	FitTile(workers[0], iX, iY, fixflag, &p[0]);
+}
+
+void FnuDivideAlign::FitTile(FnuAlignWorker *w, double iX, double iY, int fixflag, double *par, const double *seed)
+{
+	// Calculate alignment parameters par[nPID*2] for the tracks in w->tile.
+	// If seed is given, the fit starts from it and the shifts are limited to seed +- pyramidWindow.
+	// The first plate, and the last plate if fixflag == 1, are fixed at 0.
+	std::vector<int> fixed(nPID, 0);
+	fixed[0] = 1;
+	if (fixflag == 1)
+		fixed[nPID - 1] = 1;
+	for (int i = 0; i < nPID * 2; i++)
+	{
+		par[i] = seed != 0 && fixed[i / 2] == 0 ? seed[i] : 0;
+	}
+	printf("Aligning iX = %.0f, iY = %.0f, ntrk = %d, robustFactor = %.1f, solver = %s, engine = %s\n", iX, iY, w->tile.ntrk, robustFactor,
+		   SolverName(solver), w->engine->GetName());
+	if (plateWindow > 0 && plateWindow < nPID)
+	{
+		FitPlateWindows(w, fixed, par, seed);
+	}
+	else
+	{
+		Minimize(w, &w->tile, fixed, par, seed);
+	}
+	printf("ncall = %d nGradCall = %d nIter = %d fval = %lf status = %d tMinimize = %.3f s\n", w->ncall, w->nGradCall, w->nIter, w->fval, w->status, w->tMinimize);
+}
+
+void FnuDivideAlign::Minimize(FnuAlignWorker *w, const alignTile *t, const std::vector<int> &fixed, double *par, const double *seed)
+{
+	// Minimize the objective of the tracks in t over the plates which are not fixed.
+	// Fixed plates keep their value in par. Free plates start from par.
+	// Shifts stay within +-30 um, or within pyramidWindow of the seed
+	std::vector<double> low(nPID * 2), high(nPID * 2);
+	for (int i = 0; i < nPID * 2; i++)
+	{
+		low[i] = seed == 0 ? -30 : seed[i] - pyramidWindow;
+		high[i] = seed == 0 ? 30 : seed[i] + pyramidWindow;
+	}
+	if (solver == kSolverGaussNewton)
+	{
+		w->gn.SetModel(residualModel);
+		double t0 = FnuWallTime();
+		w->status = w->gn.Solve(t, nPID, fixed, robustFactor, &low[0], &high[0], par);
+		w->tMinimize = FnuWallTime() - t0;
+		w->ncall = w->gn.GetNIterations();
+		w->nGradCall = 0;
+		w->nIter = w->gn.GetNIterations();
+		w->fval = w->gn.GetFval();
+		return;
+	}
+	w->engine->SetModel(residualModel);
+	w->engine->LoadTile(t, nPID * 2);
+	w->engine->SetInlierFreeze(freezeCalls, freezeStep);
+	w->robustFactor = robustFactor;
+	w->nParams = nPID * 2;
+	// One minimizer per worker, which calls w->Eval
+	FnuMinimizer *minimizer = w->minimizer;
+	minimizer->SetFunction(w);
+	w->freePar.clear();
+	for (int pid = 0; pid < nPID; pid++)
+	{
+		double sx = par[2 * pid], sy = par[2 * pid + 1];
+		if (fixed[pid] != 0)
+		{
+			minimizer->SetParameter(2 * pid, sx, 0, 0, 0);
+			minimizer->SetParameter(2 * pid + 1, sy, 0, 0, 0);
+			continue;
+		}
+		double step = seed == 0 ? 0.1 : 0.02;
+		minimizer->SetParameter(2 * pid, sx, step, low[2 * pid], high[2 * pid]);
+		minimizer->SetParameter(2 * pid + 1, sy, step, low[2 * pid + 1], high[2 * pid + 1]);
+		w->freePar.push_back(2 * pid);
+		w->freePar.push_back(2 * pid + 1);
+	}
+
+	// L-BFGS always needs a gradient. With numerical derivatives it gets the central differences of EvalStencil.
+	bool gradient = gradientMode != kGradientNumerical || minimizer->RequiresGradient();
+	minimizer->SetGradient(gradient);
+	if (gradientMode == kGradientCheck)
+	{
+		CheckGradient(w, par);
+	}
+	w->batchGradient = gradientMode == kGradientBatch || (gradientMode == kGradientNumerical && gradient);
+
+	// minimize
+	minimizer->SetMaxCalls(200000); // number of function calls
+	minimizer->SetTolerance(0.001);
+	w->ncall = 0;
+	w->status = minimizer->Minimize();
+	w->fval = minimizer->GetFval();
+	const minimizerStats &ms = minimizer->GetStats();
+	w->ncall = ms.nCall;
+	w->nGradCall = ms.nGradCall;
+	w->tMinimize = ms.tMinimize;
+	w->nIter = ms.nIter;
+
+	// get result
+	for (int i = 0; i < nPID * 2; ++i)
+	{
+		par[i] = minimizer->GetParameter(i);
+	}
+	if (freezeCalls > 0)
+	{
+		// fval of the tracks ranked at the result instead of a frozen set
+		w->engine->ReleaseInliers();
+		w->fval = w->engine->Eval(par, robustFactor);
+	}
+}
+
+void FnuDivideAlign::FitPlateWindows(FnuAlignWorker *w, const std::vector<int> &fixed, double *par, const double *seed)
+{
+	// Block coordinate descent over windows of plateWindow consecutive plates which overlap by plateOverlap plates.
+	// A window is fitted with the segments of its plates only, so the cost of one fit does not grow with nPID.
+	// The first plate of a window is shared with the previous window and is fixed at its current shift,
+	// which carries the position of the previous windows. The other shared plates are refitted by both windows,
+	// and the windows are swept until no shift changes by more than sweepTolerance.
+	int step = plateWindow - plateOverlap;
+	assert(step > 0);
+	std::vector<int> first;
+	for (int b = 0; b + plateWindow < nPID + step; b += step)
+	{
+		first.push_back(b + plateWindow <= nPID ? b : nPID - plateWindow);
+	}
+	std::vector<int> windowFixed(nPID);
+	std::vector<double> prev(nPID * 2);
+	int ncall = 0, nGradCall = 0, nIter = 0, status = 0;
+	double fval = 0, tMinimize = 0;
+	int sweep;
+	for (sweep = 0; sweep < maxSweeps; sweep++)
+	{
+		prev.assign(par, par + nPID * 2);
+		fval = 0;
+		status = 0;
+		for (int k = 0; k < first.size(); k++)
+		{
+			int b = first[k], e = first[k] + plateWindow;
+			for (int pid = 0; pid < nPID; pid++)
+			{
+				windowFixed[pid] = fixed[pid] != 0 || pid < b || pid >= e || (k > 0 && pid == b);
+			}
+
+			// tracks with at least 3 segments in the window
+			const alignTile &t = w->tile;
+			alignTile &wt = w->windowTile;
+			wt.Clear();
+			for (int itrk = 0; itrk < t.ntrk; itrk++)
+			{
+				int n = 0;
+				for (int i = t.offset[itrk]; i < t.offset[itrk + 1]; i++)
+				{
+					if (t.pid[i] >= b && t.pid[i] < e)
+						n++;
+				}
+				if (n < 3)
+					continue;
+				for (int i = t.offset[itrk]; i < t.offset[itrk + 1]; i++)
+				{
+					if (t.pid[i] >= b && t.pid[i] < e)
+						wt.AddSegment(t.pid[i], t.x[i], t.y[i], t.z[i]);
+				}
+				wt.AddTrack(t.tx_first8[itrk], t.ty_first8[itrk]);
+			}
+			if (wt.ntrk < 20)
+			{
+				printf("Plates %d-%d: ntrk = %d, not fitted\n", b, e - 1, wt.ntrk);
+				continue;
+			}
+			// later sweeps start from the shifts of the previous sweep, within the same bounds
+			Minimize(w, &wt, windowFixed, par, seed);
+			ncall += w->ncall;
+			tMinimize += w->tMinimize;
+			nGradCall += w->nGradCall;
+			nIter += w->nIter;
+			fval += w->fval;
+			if (w->status != 0)
+				status = w->status;
+		}
+		double maxChange = 0;
+		for (int i = 0; i < nPID * 2; i++)
+		{
+			maxChange = fmax(maxChange, fabs(par[i] - prev[i]));
+		}
+		printf("Plate windows: sweep %d, %d windows of %d plates, fval = %lf, max change = %.3f\n", sweep, (int)first.size(), plateWindow, fval, maxChange);
+		if (maxChange < sweepTolerance)
+			break;
+	}
+	w->ncall = ncall;
+	w->tMinimize = tMinimize;
+	w->nGradCall = nGradCall;
+	w->nIter = nIter;
+	w->fval = fval;
+	w->status = sweep < maxSweeps ? status : 1;
+}
+
+void FnuDivideAlign::CheckGradient(FnuAlignWorker *w, const double *par)
+{
+	// Compare the analytic gradient at the initial parameters with the central differences of EvalStencil
+	double *params = &w->params[0];
+	double *grad = &w->grad[0];
+	for (int i = 0; i < nPID * 2; i++)
+	{
+		params[i] = par[i];
+	}
+	std::vector<double> numerical(nPID * 2);
+	w->EvalStencil(&numerical[0]);
+	w->engine->Eval(params, robustFactor, grad);
+	double maxDiff = 0, maxGrad = 0;
+	int maxPar = -1;
+	for (int j = 0; j < w->freePar.size(); j++)
+	{
+		int i = w->freePar[j];
+		if (fabs(grad[i] - numerical[i]) > maxDiff)
+		{
+			maxDiff = fabs(grad[i] - numerical[i]);
+			maxPar = i;
+		}
+		if (fabs(numerical[i]) > maxGrad)
+			maxGrad = fabs(numerical[i]);
+	}
+	printf("Gradient check: max |analytic - numerical| = %g (parameter %d), max |numerical| = %g\n", maxDiff, maxPar, maxGrad);
+}
+
+static void CalcLSM(const double x[], const double y[], int N, double &a0, double &a1)
+{
+	// y = a0 + a1*x, same as FnuQualityCheck::CalcLSM
+	double A00 = 0, A01 = 0, A02 = 0, A11 = 0, A12 = 0;
+	for (int i = 0; i < N; i++)
+	{
+		A00 += 1.0;
+		A01 += x[i];
+		A02 += y[i];
+		A11 += x[i] * x[i];
+		A12 += x[i] * y[i];
+	}
+	a0 = (A02 * A11 - A01 * A12) / (A00 * A11 - A01 * A01);
+	a1 = (A00 * A12 - A01 * A02) / (A00 * A11 - A01 * A01);
+}
+
+void FnuDivideAlign::CalcTileQuality(const alignTile &t, const double *par, alignTileQuality &q)
+{
+	// Residuals of the tracks of a tile with the shifts par, or without shifts if par == 0.
+	// Segments of a track are in the order of the plates.
+	double sumX = 0, sumY = 0, sumX2 = 0, sumY2 = 0;
+	q.n = 0;
+	for (int itrk = 0; itrk < t.ntrk; itrk++)
+	{
+		for (int i = t.offset[itrk]; i + 5 <= t.offset[itrk + 1]; i++)
+		{
+			if (t.pid[i + 4] - t.pid[i] != 4)
+				continue;
+			// line through the 2 segments upstream and the 2 downstream
+			double x[5], y[5], z[5];
+			for (int k = 0; k < 5; k++)
+			{
+				int pid = t.pid[i + k];
+				x[k] = t.x[i + k] + (par != 0 ? par[pid * 2] : 0);
+				y[k] = t.y[i + k] + (par != 0 ? par[pid * 2 + 1] : 0);
+				z[k] = t.z[i + k];
+			}
+			double z_updown[4] = {z[0], z[1], z[3], z[4]};
+			double x_updown[4] = {x[0], x[1], x[3], x[4]};
+			double y_updown[4] = {y[0], y[1], y[3], y[4]};
+			double a0, slopeX, slopeY;
+			CalcLSM(z_updown, x_updown, 4, a0, slopeX);
+			double dx = x[2] - (a0 + slopeX * z[2]);
+			CalcLSM(z_updown, y_updown, 4, a0, slopeY);
+			double dy = y[2] - (a0 + slopeY * z[2]);
+			if (fabs(dx) > 2 || fabs(dy) > 2)
+				continue;
+			sumX += dx;
+			sumY += dy;
+			sumX2 += dx * dx;
+			sumY2 += dy * dy;
+			q.n++;
+		}
+	}
+	q.meanX = q.n > 0 ? sumX / q.n : 0;
+	q.meanY = q.n > 0 ? sumY / q.n : 0;
+	q.sigmaX = q.n > 0 ? sqrt(fmax(0, sumX2 / q.n - q.meanX * q.meanX)) : 0;
+	q.sigmaY = q.n > 0 ? sqrt(fmax(0, sumY2 / q.n - q.meanY * q.meanY)) : 0;
+}
+
+int FnuDivideAlign::CountPassedSeg(EdbTrackP *t, double iX, double iY)
+{
+	// Count a number of segments in one track which passed a divided area
+	int count = 0;
+	for (int iseg = 0; iseg < t->N(); iseg++)
+	{
+		EdbSegP *s = t->GetSegment(iseg);
+		if (fabs(s->X() - iX) < binWidth / 2 && fabs(s->Y() - iY) < binWidth / 2)
+			count++;
+	}
+	return count;
+}
+
+void FnuDivideAlign::ApplyAlign(EdbTrackP *t, double iX, double iY)
+{
+	// Apply alignment to segments which passed a divided area
+	for (int iseg = 0; iseg < t->N(); iseg++)
+	{
+		EdbSegP *s = t->GetSegment(iseg);
+		if (fabs(s->X() - iX) < binWidth / 2 && fabs(s->Y() - iY) < binWidth / 2)
+		{
+			int pid = s->PID();
+			s->SetX(s->X() + p[pid * 2]);
+			s->SetY(s->Y() + p[pid * 2 + 1]);
+		}
+	}
+}
+
+void FnuDivideAlign::FitLevel(int level, const FnuTileIndex *parent, const std::vector<double> &parentShift, const std::vector<int> &parentFitted,
+							  std::vector<double> &shift, std::vector<int> &fitted)
+{
+	// Fit all tiles of index. Tiles are seeded with the shifts of the parent tile if it was fitted.
+	// With adaptive tiling, a tile below the coarsest level is fitted only if it has adaptiveTracks
+	// track candidates and its parent tile has shifts.
+	std::vector<int> tiles;
+	for (int iy = 0; iy < index.NY(); iy++)
+	{
+		for (int ix = 0; ix < index.NX(); ix++)
+		{
+			int itile = index.Tile(ix, iy);
+			if (index.NCandidates(itile) < 20)
+			{
+				continue;
+			}
+			if (adaptiveTracks > 0 && parent != 0)
+			{
+				int jtile = parent->FindTile(index.CenterX(ix), index.CenterY(iy));
+				if (index.NCandidates(itile) < adaptiveTracks || jtile < 0 || parentFitted[jtile] == 0)
+					continue;
+			}
+			tiles.push_back(itile);
+		}
+	}
+	shift.assign(index.NTiles() * nPID * 2, 0.0);
+	fitted.assign(index.NTiles(), 0);
+	char settings[256];
+	snprintf(settings, sizeof(settings), "binWidth=%g robustFactor=%g fixflag=0 solver=%d gradient=%d engine=%d window=%g plates=%d,%d,%d freeze=%d,%g adaptive=%d model=%d",
+			 index.BinWidth(), robustFactor, solver, gradientMode, engineType, pyramidWindow, plateWindow, plateOverlap, maxSweeps, freezeCalls, freezeStep, adaptiveTracks, residualModel);
+
+	// Tiles have disjoint segments, so they are fitted independently.
+	// The result of a tile does not depend on which thread fits it.
+	// The most expensive tiles are dispatched first and threads which become free take the next tile,
+	// so that the level does not end waiting for one dense tile. Results stay in tile order.
+	std::vector<double> cost(tiles.size());
+	std::vector<int> order(tiles.size());
+	for (int i = 0; i < tiles.size(); i++)
+	{
+		cost[i] = index.EstimateCost(tiles[i]);
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&cost](int a, int b) { return cost[a] > cost[b]; });
+	int nstat = tileStats.size();
+	tileStats.resize(nstat + tiles.size());
+#pragma omp parallel for schedule(dynamic, 1) num_threads(nThreads)
+	for (int k = 0; k < order.size(); k++)
+	{
+		int i = order[k];
+		double t0 = FnuWallTime();
+		FnuAlignWorker *w = workers[omp_get_thread_num()];
+		int itile = tiles[i];
+		double iX = index.CenterX(itile % index.NX());
+		double iY = index.CenterY(itile / index.NX());
+		alignTileStat &st = tileStats[nstat + i];
+		st = alignTileStat();
+		st.level = level;
+		st.iX = iX;
+		st.iY = iY;
+		st.cost = cost[i];
+		st.solver = solver;
+		const double *seed = 0;
+		if (parent != 0)
+		{
+			int jtile = parent->FindTile(iX, iY);
+			if (jtile >= 0 && parentFitted[jtile])
+				seed = &parentShift[jtile * nPID * 2];
+		}
+		index.FillTile(itile, w->tile);
+		double *par = &shift[itile * nPID * 2];
+		fitted[itile] = 1;
+		st.ntrk = w->tile.ntrk;
+		st.nseg = w->tile.NSeg();
+		double tFill = FnuWallTime() - t0;
+
+		// reuse the result of an earlier run
+		tileResult r;
+		unsigned long long key = 0;
+		if (cache.IsEnabled())
+		{
+			key = FnuTileCache::Key(w->tile, seed, nPID * 2, settings);
+			if (cache.Load(key, r) == 0 && r.nPar == nPID * 2)
+			{
+				printf("Aligning iX = %.0f, iY = %.0f, read from cache, fval = %lf status = %d\n", iX, iY, r.fval, r.status);
+				for (int j = 0; j < r.nPar; j++)
+				{
+					par[j] = r.p[j];
+				}
+				st.cached = 1;
+				CalcTileQuality(w->tile, 0, st.before);
+				CalcTileQuality(w->tile, par, st.after);
+				st.ncall = r.ncall;
+				st.status = r.status;
+				st.fval = r.fval;
+				st.tSetup = tFill;
+				st.tTotal = FnuWallTime() - t0;
+				continue;
+			}
+		}
+
+		// calculate the alignment parameters several times.
+		w->engine->ResetStats();
+		for (int j = 0; j < 1; j++)
+		{
+			FitTile(w, iX, iY, 0, par, seed);
+		}
+		const alignEngineStats &es = w->engine->GetStats();
+		st.ncall = w->ncall;
+		st.nGradCall = w->nGradCall;
+		st.nIter = w->nIter;
+		st.status = w->status;
+		st.fval = w->fval;
+		st.threshold = es.threshold;
+		st.nEval = es.nEval;
+		st.nEvalFrozen = es.nEvalFrozen;
+		st.tSetup = tFill + es.tLoad;
+		st.tTransfer = es.tTransfer;
+		st.tKernel = es.tKernel;
+		st.tTrimmedSum = es.tTrimmedSum;
+		st.tGrad = es.tGrad;
+		st.tTotal = FnuWallTime() - t0;
+		st.tMinimizer = st.tTotal - st.tSetup - es.tTransfer - es.tKernel - es.tTrimmedSum - es.tGrad;
+		st.tMinimize = w->tMinimize;
+		CalcTileQuality(w->tile, 0, st.before);
+		CalcTileQuality(w->tile, par, st.after);
+		printf("iX = %.0f, iY = %.0f, residual sigma x %.3f -> %.3f, y %.3f -> %.3f (%d)\n", iX, iY,
+			   st.before.sigmaX, st.after.sigmaX, st.before.sigmaY, st.after.sigmaY, st.after.n);
+		if (cache.IsEnabled())
+		{
+			r.nPar = nPID * 2;
+			r.status = w->status;
+			r.ncall = w->ncall;
+			r.fval = w->fval;
+			r.p.assign(par, par + r.nPar);
+			cache.Store(key, r);
+		}
+	}
+}
+
+int FnuDivideAlign::Align(TObjArray *tracks, double Xcenter, double Ycenter, int nPatterns)
+{
+	// Divide the area, Calculate alignment parameters and apply alignment
+	nPID = nPatterns;
+	if (nThreads > 1)
+		ROOT::EnableThreadSafety();
+	CreateWorkers();
+	delete alignPar;
+	alignPar = new TTree("alignPar", "alignPar");
+	alignPar->Branch("iX", &iXBranchValue);
+	alignPar->Branch("iY", &iYBranchValue);
+	alignPar->Branch("shiftX", &shiftXBranchValue);
+	alignPar->Branch("shiftY", &shiftYBranchValue);
+	alignPar->Branch("pid", &pidBranchValue);
+	alignPar->Branch("width", &widthBranchValue);
+	tileStats.clear();
+
+	// With pyramid levels, tiles of 2^level*binWidth are fitted first and seed the tiles of the next level.
+	// A tile of a level is exactly 2x2 tiles of the next level because all levels start at Xcenter - rangeXY,
+	// and every tile has a parent because a level has n/2^level tiles per side, rounded up, for n tiles of the finest level.
+	// With adaptive tiling, tiles which are not fitted keep the shifts of their parent tile,
+	// and source is the level of the tile whose fit gives the shifts of a tile.
+	FnuTileIndex parent;
+	std::vector<double> parentShift, shift;
+	std::vector<int> parentFitted, fitted;
+	std::vector<int> parentSource, source;
+	std::vector<FnuAlignMap> levelMaps(pyramidLevels);
+	for (int level = pyramidLevels - 1; level >= 0; level--)
+	{
+		// Bucket segments into the tiles once
+		index.Build(tracks, Xcenter, Ycenter, rangeXY, binWidth, 1 << level);
+		bool top = level == pyramidLevels - 1;
+		FitLevel(level, top ? 0 : &parent, parentShift, parentFitted, shift, fitted);
+		source.assign(index.NTiles(), -1);
+		levelMaps[level].Init(index.NX(), index.NY(), index.CenterX(0) - index.BinWidth() / 2, index.CenterY(0) - index.BinWidth() / 2, index.BinWidth(), nPID);
+		for (int itile = 0; itile < index.NTiles(); itile++)
+		{
+			if (fitted[itile] != 0)
+			{
+				source[itile] = level;
+				levelMaps[level].SetShift(itile, &shift[itile * nPID * 2], level);
+				continue;
+			}
+			int jtile = top ? -1 : parent.FindTile(index.CenterX(itile % index.NX()), index.CenterY(itile / index.NX()));
+			if (adaptiveTracks > 0 && jtile >= 0 && parentFitted[jtile] != 0)
+			{
+				std::copy(&parentShift[jtile * nPID * 2], &parentShift[(jtile + 1) * nPID * 2], &shift[itile * nPID * 2]);
+				fitted[itile] = 1;
+				source[itile] = parentSource[jtile];
+			}
+		}
+		std::swap(parent, index);
+		parentShift.swap(shift);
+		parentFitted.swap(fitted);
+		parentSource.swap(source);
+	}
+	std::swap(parent, index);
+	parentShift.swap(shift);
+	parentFitted.swap(fitted);
+	parentSource.swap(source);
+
+	// Results are kept as a map and applied to all segments in one pass
+	map.Init(index.NX(), index.NY(), index.CenterX(0) - index.BinWidth() / 2, index.CenterY(0) - index.BinWidth() / 2, index.BinWidth(), nPID);
+	for (int itile = 0; itile < index.NTiles(); itile++)
+	{
+		if (fitted[itile] != 0)
+			map.SetShift(itile, &shift[itile * nPID * 2], source[itile]);
+	}
+	map.Apply(tracks, interpolate);
+
+	// Results are written in the order of the tiles, one tile per fit which gives the shifts of the map.
+	// Without adaptive tiling these are the fitted tiles of the finest level.
+	FillAlignStat();
+	std::vector<std::vector<int> > used(pyramidLevels);
+	for (int level = 0; level < pyramidLevels; level++)
+	{
+		used[level].assign(levelMaps[level].NX() * levelMaps[level].NY(), 0);
+	}
+	for (int itile = 0; itile < map.NX() * map.NY(); itile++)
+	{
+		if (!map.IsFitted(itile))
+			continue;
+		const FnuAlignMap &m = levelMaps[map.GetLevel(itile)];
+		used[map.GetLevel(itile)][m.FindTile(map.CenterX(itile % map.NX()), map.CenterY(itile / map.NX()))] = 1;
+	}
+	for (int level = pyramidLevels - 1; level >= 0; level--)
+	{
+		const FnuAlignMap &m = levelMaps[level];
+		for (int itile = 0; itile < m.NX() * m.NY(); itile++)
+		{
+			if (used[level][itile] == 0)
+				continue;
+			const double *par = m.GetShift(itile);
+			iXBranchValue = m.CenterX(itile % m.NX());
+			iYBranchValue = m.CenterY(itile / m.NX());
+			widthBranchValue = binWidth * (1 << level);
+			for (pidBranchValue = 0; pidBranchValue < nPID; pidBranchValue++)
+			{
+				shiftXBranchValue = par[pidBranchValue * 2];
+				shiftYBranchValue = par[pidBranchValue * 2 + 1];
+				alignPar->Fill();
+			}
+		}
+	}
+	return 0;
+}
+
+void FnuDivideAlign::FillAlignStat()
+{
+	// TTree of the telemetry and the residuals of the tiles, one entry per tile fit in the order of levels and tiles
+	delete alignStat;
+	alignStat = new TTree("alignStat", "alignStat");
+	alignTileStat &st = statBranchValue;
+	alignStat->Branch("level", &st.level);
+	alignStat->Branch("iX", &st.iX);
+	alignStat->Branch("iY", &st.iY);
+	alignStat->Branch("ntrk", &st.ntrk);
+	alignStat->Branch("nseg", &st.nseg);
+	alignStat->Branch("cost", &st.cost);
+	alignStat->Branch("cached", &st.cached);
+	alignStat->Branch("solver", &st.solver);
+	alignStat->Branch("ncall", &st.ncall);
+	alignStat->Branch("nGradCall", &st.nGradCall);
+	alignStat->Branch("nIter", &st.nIter);
+	alignStat->Branch("nEval", &st.nEval);
+	alignStat->Branch("nEvalFrozen", &st.nEvalFrozen);
+	alignStat->Branch("status", &st.status);
+	alignStat->Branch("fval", &st.fval);
+	alignStat->Branch("threshold", &st.threshold);
+	alignStat->Branch("tSetup", &st.tSetup);
+	alignStat->Branch("tTransfer", &st.tTransfer);
+	alignStat->Branch("tKernel", &st.tKernel);
+	alignStat->Branch("tTrimmedSum", &st.tTrimmedSum);
+	alignStat->Branch("tGrad", &st.tGrad);
+	alignStat->Branch("tMinimizer", &st.tMinimizer);
+	alignStat->Branch("tMinimize", &st.tMinimize);
+	alignStat->Branch("tTotal", &st.tTotal);
+	alignStat->Branch("nResBefore", &st.before.n);
+	alignStat->Branch("meanXBefore", &st.before.meanX);
+	alignStat->Branch("meanYBefore", &st.before.meanY);
+	alignStat->Branch("sigmaXBefore", &st.before.sigmaX);
+	alignStat->Branch("sigmaYBefore", &st.before.sigmaY);
+	alignStat->Branch("nResAfter", &st.after.n);
+	alignStat->Branch("meanXAfter", &st.after.meanX);
+	alignStat->Branch("meanYAfter", &st.after.meanY);
+	alignStat->Branch("sigmaXAfter", &st.after.sigmaX);
+	alignStat->Branch("sigmaYAfter", &st.after.sigmaY);
+	for (int i = 0; i < tileStats.size(); i++)
+	{
+		st = tileStats[i];
+		alignStat->Fill();
+	}
+}
+
+void FnuDivideAlign::WriteAlignPar(TString filename)
+{
+	// Write TTree for Shifts of alignment, and the telemetry and the residuals of the tiles
+	TFile fout1(filename, "recreate");
+	alignPar->Write();
+	if (alignStat != 0)
+		alignStat->Write();
+	fout1.Close();
+}
+
+void FnuDivideAlign::WriteAlignMap(TString filename)
+{
+	// Write the shifts of the last Align as a map, which FnuAlignMap::Read loads
+	map.Write(filename);
+}
@@ -0,0 +1,401 @@
+#include "FnuMinimizer.h"
+#include "FnuAlignEngine.h"
+
+#include <stdio.h>
+#include <math.h>
+#include <float.h>
+#include <string>
+
+#include <TFitter.h>
+#include <TString.h>
+#include <Math/Minimizer.h>
+#include <Math/Factory.h>
+#include <Math/Functor.h>
+#include <Math/IFunction.h>
+
+FnuMinimizer::FnuMinimizer(int n)
+	: nPar(n), value(n, 0.0), step(n, 0.0), low(n, 0.0), high(n, 0.0), result(n, 0.0), fval(0), useGradient(false), maxCalls(200000), tolerance(0.001), function(0)
+{
+	stats.nCall = stats.nGradCall = stats.nIter = 0;
+	stats.tMinimize = 0;
+}
+
+void FnuMinimizer::SetParameter(int i, double v, double st, double lo, double hi)
+{
+	// lo >= hi leaves the parameter without bounds, as in TFitter
+	value[i] = v;
+	step[i] = st;
+	low[i] = lo < hi ? lo : -HUGE_VAL;
+	high[i] = lo < hi ? hi : HUGE_VAL;
+}
+
+double FnuMinimizer::Call(const double *p, double *g)
+{
+	stats.nCall++;
+	if (g != 0)
+		stats.nGradCall++;
+	return function->Eval(p, g);
+}
+
+int FnuMinimizer::Minimize()
+{
+	stats.nCall = stats.nGradCall = stats.nIter = 0;
+	double t0 = FnuWallTime();
+	int status = DoMinimize();
+	stats.tMinimize = FnuWallTime() - t0;
+	return status;
+}
+
+// Minimizer which runs Minuit in this thread, used by fitfuncRobust
+static thread_local FnuMinimizerMinuit *gMinimizer;
+
+static void fitfuncRobust(Int_t &npar, Double_t *grad, Double_t &fval, Double_t *p, Int_t iflag)
+{
+	// Fit function for TMinuit. Minuit asks for the gradient with iflag == 2 after SET GRAdient.
+	fval = gMinimizer->Call(p, iflag == 2 ? grad : 0);
+}
+
+FnuMinimizerMinuit::FnuMinimizerMinuit(int n)
+	: FnuMinimizer(n), minuit(new TFitter(n))
+{
+}
+
+FnuMinimizerMinuit::~FnuMinimizerMinuit()
+{
+	delete minuit;
+}
+
+int FnuMinimizerMinuit::DoMinimize()
+{
+	// minuit->BuildArrays(30);
+	// Int_t SetParameter(Int_t ipar, const char* parname, Double_t value, Double_t verr, Double_t vlow, Double_t vhigh)
+	for (int i = 0; i < nPar; i++)
+	{
+		bool bounded = low[i] > -HUGE_VAL;
+		minuit->SetParameter(i, Form("p%d", i), value[i], step[i], bounded ? low[i] : 0, bounded ? high[i] : 0);
+	}
+	minuit->SetFCN(fitfuncRobust);
+
+	double arglist[200];
+	arglist[0] = 0;
+	// set print level. arglist[0]==0 is minimum print.
+	minuit->ExecuteCommand("SET PRIntout", arglist, 1);
+	if (useGradient)
+	{
+		arglist[0] = 1; // use the gradient without the check by Minuit
+		minuit->ExecuteCommand("SET GRAdient", arglist, 1);
+	}
+	else
+	{
+		minuit->ExecuteCommand("SET NOGradient", arglist, 0);
+	}
+
+	// minimize
+	arglist[0] = maxCalls; // number of function calls
+	arglist[1] = tolerance;
+	minuit->SetMaxIterations(10000);
+	gMinimizer = this;
+	int status = minuit->ExecuteCommand("MIGRAD2", arglist, 2);
+	double edm, errdef;
+	int nvpar, nparx;
+	minuit->GetStats(fval, edm, errdef, nvpar, nparx);
+
+	// get result
+	for (int i = 0; i < nPar; ++i)
+	{
+		result[i] = minuit->GetParameter(i);
+	}
+	return status;
+}
+
+// Function with gradient for ROOT::Math::Minimizer which calls the minimizer
+class FnuMinimizerGradFunction : public ROOT::Math::IMultiGradFunction
+{
+private:
+	FnuMinimizer *minimizer;
+	mutable std::vector<double> grad;
+
+	double DoEval(const double *p) const { return minimizer->Call(p, 0); }
+	double DoDerivative(const double *p, unsigned int i) const
+	{
+		minimizer->Call(p, &grad[0]);
+		return grad[i];
+	}
+
+public:
+	FnuMinimizerGradFunction(FnuMinimizer *m) : minimizer(m), grad(m->NPar()) {}
+	unsigned int NDim() const { return minimizer->NPar(); }
+	ROOT::Math::IMultiGenFunction *Clone() const { return new FnuMinimizerGradFunction(minimizer); }
+	void Gradient(const double *p, double *g) const { minimizer->Call(p, g); }
+	void FdF(const double *p, double &f, double *g) const { f = minimizer->Call(p, g); }
+};
+
+FnuMinimizerMinuit2::FnuMinimizerMinuit2(int n)
+	: FnuMinimizer(n), minuit2(ROOT::Math::Factory::CreateMinimizer("Minuit2", "Migrad"))
+{
+	// The plugin is loaded here, before the threads start
+	if (minuit2 == 0)
+		printf("Minuit2 is not available in this ROOT\n");
+}
+
+FnuMinimizerMinuit2::~FnuMinimizerMinuit2()
+{
+	delete minuit2;
+}
+
+int FnuMinimizerMinuit2::DoMinimize()
+{
+	// Minuit2 clones the function, which keeps calling this minimizer
+	minuit2->Clear();
+	minuit2->SetPrintLevel(0);
+	minuit2->SetMaxFunctionCalls(maxCalls);
+	minuit2->SetMaxIterations(10000);
+	minuit2->SetTolerance(tolerance);
+	FnuMinimizerGradFunction gradFunction(this);
+	ROOT::Math::Functor valueFunction([this](const double *p) { return Call(p, 0); }, nPar);
+	if (useGradient)
+		minuit2->SetFunction(gradFunction);
+	else
+		minuit2->SetFunction(valueFunction);
+	for (int i = 0; i < nPar; i++)
+	{
+		std::string name = Form("p%d", i);
+		if (IsFixed(i))
+			minuit2->SetFixedVariable(i, name, value[i]);
+		else if (low[i] > -HUGE_VAL)
+			minuit2->SetLimitedVariable(i, name, value[i], step[i], low[i], high[i]);
+		else
+			minuit2->SetVariable(i, name, value[i], step[i]);
+	}
+
+	minuit2->Minimize();
+	fval = minuit2->MinValue();
+	const double *x = minuit2->X();
+	for (int i = 0; i < nPar; i++)
+	{
+		result[i] = x[i];
+	}
+	stats.nIter = minuit2->NIterations();
+	return minuit2->Status();
+}
+
+FnuMinimizerLBFGS::FnuMinimizerLBFGS(int n, int history)
+	: FnuMinimizer(n), nHistory(history), x(n), g(n), xNew(n), gNew(n), d(n), alpha(history)
+{
+}
+
+void FnuMinimizerLBFGS::Direction(const std::vector<int> &active)
+{
+	// d = -H g on the free parameters by the two-loop recursion, 0 on the held parameters.
+	// The products are taken over the free parameters, so the held ones do not enter H.
+	int m = s.size();
+	std::vector<double> rho(m, 0.0);
+	for (int i = 0; i < nPar; i++)
+	{
+		d[i] = active[i] ? 0 : -g[i];
+	}
+	for (int k = m - 1; k >= 0; k--)
+	{
+		double sy = 0, sd = 0;
+		for (int i = 0; i < nPar; i++)
+		{
+			if (active[i])
+				continue;
+			sy += s[k][i] * y[k][i];
+			sd += s[k][i] * d[i];
+		}
+		if (sy <= 0)
+			continue;
+		rho[k] = 1 / sy;
+		alpha[k] = rho[k] * sd;
+		for (int i = 0; i < nPar; i++)
+		{
+			if (!active[i])
+				d[i] -= alpha[k] * y[k][i];
+		}
+	}
+	if (m > 0)
+	{
+		// initial inverse Hessian scaled by the newest pair
+		double sy = 0, yy = 0;
+		for (int i = 0; i < nPar; i++)
+		{
+			if (active[i])
+				continue;
+			sy += s[m - 1][i] * y[m - 1][i];
+			yy += y[m - 1][i] * y[m - 1][i];
+		}
+		double gamma = sy > 0 && yy > 0 ? sy / yy : 1;
+		for (int i = 0; i < nPar; i++)
+		{
+			d[i] *= gamma;
+		}
+	}
+	for (int k = 0; k < m; k++)
+	{
+		if (rho[k] == 0)
+			continue;
+		double yd = 0;
+		for (int i = 0; i < nPar; i++)
+		{
+			if (!active[i])
+				yd += y[k][i] * d[i];
+		}
+		double beta = rho[k] * yd;
+		for (int i = 0; i < nPar; i++)
+		{
+			if (!active[i])
+				d[i] += s[k][i] * (alpha[k] - beta);
+		}
+	}
+}
+
+int FnuMinimizerLBFGS::DoMinimize()
+{
+	// Returns 0 if the estimated distance to the minimum went below the tolerance or a step
+	// decreased the function by less than its float precision, 1 if the calls ran out and 4 if no step along the gradient decreased the function.
+	double minStep = HUGE_VAL;
+	for (int i = 0; i < nPar; i++)
+	{
+		x[i] = IsFixed(i) ? value[i] : Project(i, value[i]);
+		if (!IsFixed(i) && step[i] < minStep)
+			minStep = step[i];
+	}
+	s.clear();
+	y.clear();
+	double f = Call(&x[0], &g[0]);
+	std::vector<int> active(nPar);
+	int status = 1;
+	for (stats.nIter = 0; stats.nCall < maxCalls; stats.nIter++)
+	{
+		// parameters at a bound with the gradient pointing outside are held in this iteration
+		for (int i = 0; i < nPar; i++)
+		{
+			active[i] = IsFixed(i) || (x[i] <= low[i] && g[i] > 0) || (x[i] >= high[i] && g[i] < 0);
+		}
+		Direction(active);
+		double gd = 0;
+		for (int i = 0; i < nPar; i++)
+		{
+			gd += g[i] * d[i];
+		}
+		if (gd >= 0 && !s.empty())
+		{
+			// not a descent direction, restart along the gradient
+			s.clear();
+			y.clear();
+			Direction(active);
+			gd = 0;
+			for (int i = 0; i < nPar; i++)
+			{
+				gd += g[i] * d[i];
+			}
+		}
+		if (gd == 0)
+		{
+			status = 0;
+			break;
+		}
+		// 0.5*g.H.g is the EDM of MIGRAD. Without history H is not known yet.
+		if (!s.empty() && -0.5 * gd < 0.002 * tolerance)
+		{
+			status = 0;
+			break;
+		}
+		if (s.empty())
+		{
+			// first step along the gradient moves the parameters by the smallest step
+			double dmax = 0;
+			for (int i = 0; i < nPar; i++)
+			{
+				dmax = fmax(dmax, fabs(d[i]));
+			}
+			for (int i = 0; i < nPar; i++)
+			{
+				d[i] *= minStep / dmax;
+			}
+		}
+
+		// backtracking line search with the Armijo condition on the projected path
+		double fNew = f;
+		bool accepted = false;
+		double a = 1;
+		for (int k = 0; k < 30 && stats.nCall < maxCalls; k++, a *= 0.5)
+		{
+			double decrease = 0;
+			for (int i = 0; i < nPar; i++)
+			{
+				xNew[i] = active[i] ? x[i] : Project(i, x[i] + a * d[i]);
+				decrease += g[i] * (xNew[i] - x[i]);
+			}
+			fNew = Call(&xNew[0], &gNew[0]);
+			if (fNew <= f + 1e-4 * decrease)
+			{
+				accepted = true;
+				break;
+			}
+		}
+		if (!accepted)
+		{
+			if (s.empty())
+			{
+				status = stats.nCall < maxCalls ? 4 : 1;
+				break;
+			}
+			s.clear();
+			y.clear();
+			continue;
+		}
+
+		std::vector<double> sk(nPar), yk(nPar);
+		double sy = 0, yy = 0;
+		for (int i = 0; i < nPar; i++)
+		{
+			sk[i] = xNew[i] - x[i];
+			yk[i] = gNew[i] - g[i];
+			sy += sk[i] * yk[i];
+			yy += yk[i] * yk[i];
+		}
+		// the trimmed sum changes its tracks between points, keep only pairs with positive curvature
+		if (sy > 1e-10 * yy)
+		{
+			if (s.size() == nHistory)
+			{
+				s.erase(s.begin());
+				y.erase(y.begin());
+			}
+			s.push_back(sk);
+			y.push_back(yk);
+		}
+		x.swap(xNew);
+		g.swap(gNew);
+		double decrease = f - fNew;
+		f = fNew;
+		// the track chi2 are summed in float, smaller changes of the sum are rounding
+		if (decrease < FLT_EPSILON * fabs(f))
+		{
+			status = 0;
+			break;
+		}
+	}
+	result = x;
+	fval = f;
+	return status;
+}
+
+FnuMinimizer *FnuCreateMinimizer(int type, int n)
+{
+	if (type == kMinimizerMinuit)
+		return new FnuMinimizerMinuit(n);
+	if (type == kMinimizerMinuit2)
+	{
+		FnuMinimizerMinuit2 *m = new FnuMinimizerMinuit2(n);
+		if (m->IsAvailable())
+			return m;
+		delete m;
+		return 0;
+	}
+	if (type == kMinimizerLBFGS)
+		return new FnuMinimizerLBFGS(n);
+	return 0;
+}
@@ -35,6 +35,7 @@ FnuQualityCheck::FnuQualityCheck(EdbPVRec *pvr, TString title)
 	SetBinsAngle(26, bins_arr_angle);
 	double bins_arr_TXTY[] = {-0.5, -0.45, -0.4, -0.35, -0.3, -0.25, -0.2, -0.19, -0.18, -0.17, -0.16, -0.15, -0.14, -0.13, -0.12, -0.11, -0.10, -0.09, -0.08, -0.07, -0.06, -0.05, -0.04, -0.03, -0.02, -0.01, 0, 0.01, 0.02, 0.03, 0.04, 0.05, 0.06, 0.07, 0.08, 0.09, 0.1, 0.11, 0.12, 0.13, 0.14, 0.15, 0.16, 0.17, 0.18, 0.19, 0.2, 0.25, 0.3, 0.35, 0.4, 0.45, 0.5};
 	SetBinsTXTY(52, bins_arr_TXTY);
+	plateIndex.Build(pvr);
 }
 
 void FnuQualityCheck::SetBinsAngle(int nbins, double bins[])
@@ -73,34 +74,23 @@ void FnuQualityCheck::CalcDeltaXY(double Xcenter, double Ycenter, double bin_wid
 	{
 		for (int itrk = 0; itrk < ntrk; itrk++)
 		{
+			// segments on the plates iPID-2..iPID+2
+			EdbSegP *s[5];
+			if (plateIndex.Window(itrk, iPID, 2, s) != 5)
+				continue;
 			EdbTrackP *t = pvr->GetTrack(itrk);
-			int count = 0;
 			double x[5];
 			double y[5];
 			double z[5];
 			nseg = t->N();
-			for (int iseg = 0; iseg < nseg; iseg++)
+			for (int ipoint = 0; ipoint < 5; ipoint++)
 			{
-				EdbSegP *s = t->GetSegment(iseg);
-				int sPID = s->PID();
-				if (sPID > iPID + 2)
-					break;
-				if (sPID < iPID - 2)
-					continue;
-				x[sPID - iPID + 2] = s->X();
-				y[sPID - iPID + 2] = s->Y();
-				z[sPID - iPID + 2] = s->Z();
-				count++;
-				if (sPID == iPID)
-				{
-					tx3 = s->TX();
-					ty3 = s->TY();
-				}
-				if (count == 5)
-					break;
+				x[ipoint] = s[ipoint]->X();
+				y[ipoint] = s[ipoint]->Y();
+				z[ipoint] = s[ipoint]->Z();
 			}
-			if (count != 5)
-				continue;
+			tx3 = s[2]->TX();
+			ty3 = s[2]->TY();
 			int areaX[5];
 			int areaY[5];
 			for (int ipoint = 0; ipoint < 5; ipoint++)
@@ -413,45 +403,24 @@ void FnuQualityCheck::CalcEfficiency()
 	for (int itrk = 0; itrk < ntrk; itrk++)
 	{
 		EdbTrackP *t = pvr->GetTrack(itrk);
-		int nseg = t->N();
+		nseg = t->N();
 		for (int iPID = 2; iPID < nPID - 2; iPID++)
 		{
 			int iplate = pvr->GetPattern(iPID)->Plate();
-			int counts = 0;
-			hitsOnThePlate = 0;
-			W = 0;
-			for (int iseg = 0; iseg < nseg; iseg++)
-			{
-				EdbSegP *s = t->GetSegment(iseg);
-				int sPID = s->PID();
-				if (sPID > iPID + 2)
-					break;
-				if (sPID < iPID - 2)
-					continue;
-				if (sPID == iPID - 2 || sPID == iPID + 2)
-					counts++;
-				if (sPID == iPID - 1)
-				{
-					x1 = s->X();
-					y1 = s->Y();
-					z1 = s->Z();
-					counts++;
-				}
-				if (sPID == iPID + 1)
-				{
-					x2 = s->X();
-					y2 = s->Y();
-					z2 = s->Z();
-					counts++;
-				}
-				if (sPID == iPID)
-				{
-					hitsOnThePlate = 1;
-					W = s->W();
-				}
-			}
+			// segments on the plates iPID-2..iPID+2. The track is expected on iPID if the other 4 plates have segments.
+			EdbSegP *s[5];
+			int counts = plateIndex.Window(itrk, iPID, 2, s);
+			hitsOnThePlate = s[2] != 0;
+			W = s[2] != 0 ? s[2]->W() : 0;
+			counts -= hitsOnThePlate;
 			if (counts == 4)
 			{
+				x1 = s[1]->X();
+				y1 = s[1]->Y();
+				z1 = s[1]->Z();
+				x2 = s[3]->X();
+				y2 = s[3]->Y();
+				z2 = s[3]->Z();
 				TX = (x2 - x1) / (z2 - z1);
 				TY = (y2 - y1) / (z2 - z1);
 				angle = sqrt(TX * TX + TY * TY);
@@ -0,0 +1,109 @@
+#include "FnuTileCache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FnuTileCache::FnuTileCache()
+{
+}
+
+int FnuTileCache::SetDirectory(const char *d)
+{
+	dir = d;
+	if (dir.empty())
+		return 0;
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+	{
+		printf("Cannot create cache directory %s\n", dir.c_str());
+		dir.clear();
+		return 1;
+	}
+	return 0;
+}
+
+static void HashBytes(unsigned long long &h, const void *data, size_t n)
+{
+	// FNV-1a
+	const unsigned char *c = (const unsigned char *)data;
+	for (size_t i = 0; i < n; i++)
+	{
+		h ^= c[i];
+		h *= 1099511628211ULL;
+	}
+}
+
+unsigned long long FnuTileCache::Key(const alignTile &tile, const double *seed, int nPar, const char *settings)
+{
+	// Hash of everything the fit result depends on
+	unsigned long long h = 14695981039346656037ULL;
+	HashBytes(h, settings, strlen(settings));
+	HashBytes(h, &nPar, sizeof(int));
+	HashBytes(h, &tile.ntrk, sizeof(int));
+	HashBytes(h, &tile.offset[0], tile.offset.size() * sizeof(int));
+	int nseg = tile.NSeg();
+	if (nseg > 0)
+	{
+		HashBytes(h, &tile.pid[0], nseg * sizeof(int));
+		HashBytes(h, &tile.x[0], nseg * sizeof(float));
+		HashBytes(h, &tile.y[0], nseg * sizeof(float));
+		HashBytes(h, &tile.z[0], nseg * sizeof(float));
+	}
+	if (tile.ntrk > 0)
+	{
+		HashBytes(h, &tile.tx_first8[0], tile.ntrk * sizeof(float));
+		HashBytes(h, &tile.ty_first8[0], tile.ntrk * sizeof(float));
+	}
+	int seeded = seed != 0;
+	HashBytes(h, &seeded, sizeof(int));
+	if (seeded)
+		HashBytes(h, seed, nPar * sizeof(double));
+	return h;
+}
+
+int FnuTileCache::Load(unsigned long long key, tileResult &r)
+{
+	// Read a stored result. Returns 1 if there is none.
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/%016llx.txt", dir.c_str(), key);
+	FILE *fp = fopen(path, "r");
+	if (fp == 0)
+		return 1;
+	int ok = fscanf(fp, "%d %d %d %lf", &r.nPar, &r.status, &r.ncall, &r.fval) == 4 && r.nPar >= 0;
+	if (ok)
+		r.p.resize(r.nPar);
+	for (int i = 0; ok && i < r.nPar; i++)
+	{
+		ok = fscanf(fp, "%lf", &r.p[i]) == 1;
+	}
+	fclose(fp);
+	return ok ? 0 : 1;
+}
+
+void FnuTileCache::Store(unsigned long long key, const tileResult &r)
+{
+	// Write to a temporary file and rename it, so that a killed job never leaves a partial result.
+	// The temporary file is per process, since jobs sharing the directory may store the same key.
+	char path[4096], tmp[4096];
+	snprintf(path, sizeof(path), "%s/%016llx.txt", dir.c_str(), key);
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+	FILE *fp = fopen(tmp, "w");
+	if (fp == 0)
+	{
+		printf("Cannot write %s\n", tmp);
+		return;
+	}
+	fprintf(fp, "%d %d %d %.17g\n", r.nPar, r.status, r.ncall, r.fval);
+	for (int i = 0; i < r.nPar; i++)
+	{
+		fprintf(fp, "%.17g\n", r.p[i]);
+	}
+	fclose(fp);
+	if (rename(tmp, path) != 0)
+	{
+		printf("Cannot rename %s to %s: %s\n", tmp, path, strerror(errno));
+		remove(tmp);
+	}
+}
@@ -0,0 +1,166 @@
+#include "FnuTileIndex.h"
+
+#include <stdio.h>
+#include <math.h>
+
+FnuTileIndex::FnuTileIndex()
+	: nX(0), nY(0), Xmin(0), Ymin(0), binWidth(1)
+{
+}
+
+int FnuTileIndex::FindTile(double x, double y) const
+{
+	// Return the tile which contains (x, y), or -1 if it is outside of the grid or on a border
+	int ix = (int)floor((x - Xmin) / binWidth);
+	int iy = (int)floor((y - Ymin) / binWidth);
+	if (ix < 0 || ix >= nX || iy < 0 || iy >= nY)
+		return -1;
+	if (fabs(x - CenterX(ix)) >= binWidth / 2 || fabs(y - CenterY(iy)) >= binWidth / 2)
+		return -1;
+	return Tile(ix, iy);
+}
+
+void FnuTileIndex::Build(TObjArray *tracks, double Xcenter, double Ycenter, double rangeXY, double bwidth, int merge)
+{
+	// Bucket segments into tiles and select the tracks used for the fit of each tile.
+	// A track is used if N>=10, its angle is within 0.01 of the mean angle and
+	// at least 10 of its segments are in the tile.
+	// With merge > 1, each tile covers merge x merge tiles of bwidth, and the grid covers all of them.
+	Xmin = Xcenter - rangeXY;
+	Ymin = Ycenter - rangeXY;
+	// same tiles of bwidth as the loop iX = Xmin + bwidth/2; iX <= Xcenter + rangeXY; iX += bwidth
+	nX = nY = 0;
+	for (double c = Xmin + bwidth / 2; c <= Xcenter + rangeXY; c += bwidth)
+		nX++;
+	for (double c = Ymin + bwidth / 2; c <= Ycenter + rangeXY; c += bwidth)
+		nY++;
+	nX = (nX + merge - 1) / merge;
+	nY = (nY + merge - 1) / merge;
+	binWidth = bwidth * merge;
+	int ntile = nX * nY;
+	int ntrk = tracks->GetEntriesFast();
+
+	double angleXSum = 0;
+	double angleYSum = 0;
+	for (int itrk = 0; itrk < ntrk; itrk++)
+	{
+		EdbTrackP *t = (EdbTrackP *)tracks->At(itrk);
+		angleXSum += t->TX();
+		angleYSum += t->TY();
+	}
+	double angleXMean = angleXSum / ntrk;
+	double angleYMean = angleYSum / ntrk;
+
+	// tile of each segment, then counting sort by tile
+	std::vector<int> segTile;
+	std::vector<EdbSegP *> allSegs;
+	std::vector<int> trkOffset(1, 0);
+	std::vector<int> count(ntile + 1, 0);
+	for (int itrk = 0; itrk < ntrk; itrk++)
+	{
+		EdbTrackP *t = (EdbTrackP *)tracks->At(itrk);
+		for (int iseg = 0; iseg < t->N(); iseg++)
+		{
+			EdbSegP *s = t->GetSegment(iseg);
+			int itile = FindTile(s->X(), s->Y());
+			segTile.push_back(itile);
+			allSegs.push_back(s);
+			if (itile >= 0)
+				count[itile + 1]++;
+		}
+		trkOffset.push_back(allSegs.size());
+	}
+	segOffset.assign(ntile + 1, 0);
+	for (int itile = 0; itile < ntile; itile++)
+		segOffset[itile + 1] = segOffset[itile] + count[itile + 1];
+	segs.assign(segOffset[ntile], 0);
+
+	std::vector<int> fill(segOffset.begin(), segOffset.end() - 1);
+	std::vector<std::vector<int> > cand(ntile);
+	std::vector<int> candSegBegin;
+	std::vector<int> candSegEnd;
+	std::vector<int> candTrk;
+	for (int itrk = 0; itrk < ntrk; itrk++)
+	{
+		EdbTrackP *t = (EdbTrackP *)tracks->At(itrk);
+		bool selected = t->N() >= 10 && fabs(t->TX() - angleXMean) < 0.01 && fabs(t->TY() - angleYMean) < 0.01;
+		for (int i = trkOffset[itrk]; i < trkOffset[itrk + 1]; i++)
+		{
+			int itile = segTile[i];
+			if (itile < 0)
+				continue;
+			// segments of this track in this tile are contiguous in segs
+			int begin = fill[itile];
+			for (int j = i; j < trkOffset[itrk + 1]; j++)
+			{
+				if (segTile[j] == itile)
+				{
+					segs[fill[itile]++] = allSegs[j];
+					segTile[j] = -1;
+				}
+			}
+			if (selected && fill[itile] - begin >= 10)
+			{
+				cand[itile].push_back(candTrk.size());
+				candTrk.push_back(itrk);
+				candSegBegin.push_back(begin);
+				candSegEnd.push_back(fill[itile]);
+			}
+		}
+	}
+
+	candOffset.assign(ntile + 1, 0);
+	candBegin.clear();
+	candEnd.clear();
+	candTrack.clear();
+	for (int itile = 0; itile < ntile; itile++)
+	{
+		for (int i = 0; i < cand[itile].size(); i++)
+		{
+			int icand = cand[itile][i];
+			candTrack.push_back((EdbTrackP *)tracks->At(candTrk[icand]));
+			candBegin.push_back(candSegBegin[icand]);
+			candEnd.push_back(candSegEnd[icand]);
+		}
+		candOffset[itile + 1] = candTrack.size();
+	}
+	printf("Tile index: %d x %d tiles, %d segments, %d track candidates\n", nX, nY, segOffset[ntile], (int)candTrack.size());
+}
+
+int FnuTileIndex::NCandidateSegments(int itile)
+{
+	// Number of segments which FillTile puts into the tile
+	int n = 0;
+	for (int i = candOffset[itile]; i < candOffset[itile + 1]; i++)
+	{
+		n += candEnd[i] - candBegin[i];
+	}
+	return n;
+}
+
+double FnuTileIndex::EstimateCost(int itile)
+{
+	// Relative cost of the fit of a tile. One evaluation of the objective fits every segment
+	// and ranks every track, and the number of evaluations grows with the number of plates in the tile.
+	int nseg = NCandidateSegments(itile);
+	int ntrk = NCandidates(itile);
+	if (ntrk == 0)
+		return 0;
+	double segPerTrk = (double)nseg / ntrk;
+	return (nseg + ntrk) * segPerTrk;
+}
+
+void FnuTileIndex::FillTile(int itile, alignTile &tile)
+{
+	// Setup structures for the candidate tracks of a tile
+	tile.Clear();
+	for (int i = candOffset[itile]; i < candOffset[itile + 1]; i++)
+	{
+		for (int j = candBegin[i]; j < candEnd[i]; j++)
+		{
+			EdbSegP *s = segs[j];
+			tile.AddSegment(s->PID(), s->X(), s->Y(), s->Z());
+		}
+		tile.AddTrack(candTrack[i]->TX(), candTrack[i]->TY());
+	}
+}